@@ -4,6 +4,11 @@
 #include <sys/mman.h>
 
 #define MMAP_THREASHOLD 128*1024
+#define NUM_SMALL_BINS 128 // exact bins, one per 8 bytes
+#define SMALL_BIN_SHIFT 10 // log2 of the first size that is not in a small bin
+#define SUB_BINS 4 // large bins per power of two
+#define NUM_BINS (NUM_SMALL_BINS + (64 - SMALL_BIN_SHIFT) * SUB_BINS)
+#define BINMAP_WORDS ((NUM_BINS + 63) / 64)
 
 size_t align (size_t size);
 void* Sbrk(size_t size)
@@ -32,6 +37,7 @@ void* Sbrk(size_t size)
 typedef struct  malloc_meta_data_t{
     size_t size;
     bool is_free;
+    bool is_mmap; // has its own mapping, a heap block may be as big
     void* p;
     malloc_meta_data_t* lower;
     malloc_meta_data_t* higher;
@@ -44,7 +50,8 @@ class MallocList {
     size_t alloc_blocks; //free & used
     size_t free_bytes;
     size_t alloc_bytes; //free & used
-    MallocMetadata* free_list_head;//  free list
+    MallocMetadata* bins[NUM_BINS];// free lists by size class, each sorted by size then address
+    uint64_t binmap[BINMAP_WORDS];// bit i is set <=> bins[i] is not empty
     MallocMetadata* mmaped_list_head;
     MallocMetadata* wilderness;// end of all blocks list
 public:
@@ -54,7 +61,14 @@ public:
         this->alloc_blocks = 0;
         this->free_bytes = 0;
         this->alloc_bytes = 0;
-        this->free_list_head = nullptr;
+        for (int i = 0; i < NUM_BINS; i++)
+        {
+            this->bins[i] = nullptr;
+        }
+        for (int i = 0; i < BINMAP_WORDS; i++)
+        {
+            this->binmap[i] = 0;
+        }
         this->wilderness = nullptr;
         this->mmaped_list_head = nullptr;
     }
@@ -74,6 +88,7 @@ public:
         if (md != nullptr) 
         {
             md->is_free = false;
+            md->is_mmap = false;
             md->lower = nullptr;
             md->higher = nullptr;
             md->free_next = nullptr;
@@ -93,6 +108,9 @@ public:
         new_free_md->lower = old_md;
         new_free_md->higher = old_md->higher;
         new_free_md->p = (char*)old_md->p + size + sizeof(MallocMetadata);
+        new_free_md->free_next = nullptr;
+        new_free_md->free_prev = nullptr;
+        new_free_md->is_mmap = false;
         if (old_md->higher != nullptr)
         {
             old_md->higher->lower = new_free_md;
@@ -110,11 +128,22 @@ public:
         
         return old_md; //newly allocated block
     }
+    // low and high must already be out of the free lists.
+    // is_free: both blocks are free and so is the result, the caller inserts it.
+    // otherwise exactly one of them is free and the result is busy.
     MallocMetadata* mergeAdjBlocks (MallocMetadata* low, MallocMetadata* high, bool is_free)
     {
         this->free_blocks--;
         this->alloc_blocks--;
         this->alloc_bytes += sizeof(MallocMetadata);
+        if (is_free)
+        {
+            this->free_bytes += sizeof(MallocMetadata);
+        }
+        else
+        {
+            this->free_bytes -= low->is_free ? low->size : high->size;
+        }
         low->size += high->size + sizeof(MallocMetadata);
         low->higher = high->higher;
         if(high->higher != nullptr)
@@ -126,74 +155,8 @@ public:
             this->wilderness = low;
         }
         if (!is_free)
-        {   
-            this->free_bytes -= (low->size - sizeof(MallocMetadata));
-            if(low->free_prev != nullptr)
-            {
-                low->free_prev->free_next = low->free_next;
-            }
-            if(low->free_next != nullptr)
-            {
-                low->free_next->free_prev = low->free_prev;
-            }
-            this->updateBusyBlock(low);
-            return low;
-        }
-        //is_free:
-        if(high == this->free_list_head)
-        {
-            this->free_list_head = low;
-        }
-        this->free_bytes += sizeof(MallocMetadata);
-        if (this->alloc_blocks == 1)
-        {
-            low->free_next = nullptr;
-            low->free_prev = nullptr;
-            return low;
-        }
-        if (low->free_next == nullptr && low->free_prev == nullptr)
-        {
-            low->free_next = high->free_next;
-            low->free_prev = high->free_prev;
-            if (high->free_prev != nullptr)
-            {
-                (high->free_prev)->free_next = low;
-            }
-            if (high->free_next != nullptr)
-            {
-                (high->free_next)->free_prev = low;
-            }
-            return low;
-        }
-        if (low->free_next == nullptr )
-        {
-            return low;
-        }
-        if (low->free_next->size < low->size || 
-        (low->free_next->size == low->size && low->free_next->p < low->p))
         {
-            (low->free_next)->free_prev = low->free_prev;
-            if (low->free_prev != nullptr)
-            {
-                (low->free_prev)->free_next = low->free_next;
-            }
-            MallocMetadata* tmp = low->free_next;
-            while(tmp->free_next != nullptr && tmp->size < low->size)
-            {
-                tmp = tmp->free_next;
-            }
-            if ((tmp->size > low->size) || (tmp->size == low->size && tmp->p < low->p))
-            {
-                tmp = tmp->free_prev;
-            }
-            //tmp ---> low ---> (tmp->free_next)
-            if (tmp->free_next != nullptr)
-            {
-                tmp->free_next->free_prev = tmp;
-            }
-            low->free_next = tmp->free_next;
-            tmp->free_next = low;
-            low->free_prev = tmp;
+            this->updateBusyBlock(low);
         }
         return low;
     }
@@ -304,11 +267,7 @@ public:
         bool merge_with_higher = (md->higher != nullptr && md->higher->is_free) && (md->size + md->higher->size >= size);
         if (merge_with_lower && ((md->size + md->lower->size >= size) || !merge_with_higher)) //mrege with lower
         {
-            if (this->free_list_head == md->lower)
-            {
-                this->free_list_head = md->lower->free_next;
-            }
-            this->free_bytes += md->size;
+            this->removeFreeBlock(md->lower);
             merged = this->mergeAdjBlocks(md->lower, md, false);
             if (merged->size >= size)
             {
@@ -317,11 +276,7 @@ public:
         }
         if (merged->higher != nullptr && merged->higher->is_free) //merge with higher
         {
-            if (this->free_list_head == merged->higher)
-            {
-                this->free_list_head = merged->higher->free_next;
-            }
-            this->free_bytes += merged->size;
+            this->removeFreeBlock(merged->higher);
             merged = this->mergeAdjBlocks(merged, merged->higher, false);
         }
         if (merged->size >= size)
@@ -339,6 +294,10 @@ public:
         else //find other block
         {
             MallocMetadata* new_md = this->findFreeBlock(size);
+            if (new_md == nullptr)
+            {
+                return nullptr;
+            }
             memmove(new_md->p, oldp, oldsize);    
             //after success we free oldp
             this->freeBlock(merged->p);
@@ -369,30 +328,25 @@ public:
         new_md->size = size;
         new_md->p = (void*)((MallocMetadata*)p + 1);
         this->updateNewBlock(new_md);
+        new_md->is_mmap = true;
         this->insertBigBlock(new_md);
         return new_md;
     }
 
     MallocMetadata* findFreeBlock (size_t size)
     {
-        MallocMetadata* tmp = this->free_list_head;
-        while (tmp != nullptr && tmp->size < size )
-        {
-            tmp = tmp->free_next;
-        }
+        MallocMetadata* tmp = this->takeFreeBlock(size);
         if (tmp == nullptr)
         {
             //if there is no other free block return (if free) wilderness that is smaller than size
             if (this->wilderness != nullptr && this->wilderness->is_free)
             {
-                if (this->free_list_head == this->wilderness)
-                {
-                    this->free_list_head = nullptr;
-                }
                 size_t old_size = this->wilderness->size;
+                this->removeFreeBlock(this->wilderness);
                 MallocMetadata* meta_ret = unionWilderness(size);
                 if (meta_ret == nullptr)
                 {//sbrk failed
+                    this->insertFreeBlock(this->wilderness);
                     return nullptr;
                 }
                 this->updateBusyBlock(this->wilderness); //updates free, free next & prev
@@ -418,10 +372,6 @@ public:
         }
         else
         {
-            if (this->free_list_head == tmp)
-            {
-                this->free_list_head = tmp->free_next;
-            }
             //there is a block that is big enough
             this->updateBusyBlock(tmp); //updates free, free next & prev
             this->free_blocks --;
@@ -470,7 +420,7 @@ public:
             return ;
         }
         MallocMetadata* md = (MallocMetadata*)((MallocMetadata*)p - 1); 
-        if (md->size >= MMAP_THREASHOLD)
+        if (md->is_mmap)
         {
             this->freeBigBlock(md);
             return;
@@ -478,26 +428,80 @@ public:
         md->is_free = true;
         this->free_blocks ++;
         this->free_bytes += md->size;
-        bool is_merged = false;
         if (md->higher != nullptr && md->higher->is_free)
         {
-            is_merged = true;
+            this->removeFreeBlock(md->higher);
             this->mergeAdjBlocks(md, md->higher, true);
         }
         if (md->lower != nullptr && md->lower->is_free)
         {
-            is_merged = true;
-            this->mergeAdjBlocks(md->lower, md, true);
+            this->removeFreeBlock(md->lower);
+            md = this->mergeAdjBlocks(md->lower, md, true);
         }
-        if (!is_merged)
+        this->insertFreeBlock(md);
+    }
+
+    static int binIndex(size_t size)
+    {
+        if (size < ((size_t)1 << SMALL_BIN_SHIFT))
         {
-            this->insertFreeBlock(md);
+            return size >> 3;
         }
+        int msb = 63 - __builtin_clzl(size);
+        int sub = (size >> (msb - 2)) & (SUB_BINS - 1);
+        return NUM_SMALL_BINS + (msb - SMALL_BIN_SHIFT) * SUB_BINS + sub;
+    }
+    //first non empty bin with index >= from, -1 if there is none
+    int nextNonEmptyBin(int from)
+    {
+        int word = from / 64;
+        if (word >= BINMAP_WORDS)
+        {
+            return -1;
+        }
+        uint64_t bits = this->binmap[word] & (~(uint64_t)0 << (from % 64));
+        while (bits == 0)
+        {
+            word++;
+            if (word == BINMAP_WORDS)
+            {
+                return -1;
+            }
+            bits = this->binmap[word];
+        }
+        return word * 64 + __builtin_ctzll(bits);
+    }
+    //best fit: smallest block that fits, lowest address among equal sizes.
+    //every block in a higher bin is bigger than every block in a lower one,
+    //so only the bin of size itself may need a walk.
+    MallocMetadata* takeFreeBlock(size_t size)
+    {
+        int idx = binIndex(size);
+        MallocMetadata* tmp = nullptr;
+        if (this->binmap[idx / 64] & ((uint64_t)1 << (idx % 64)))
+        {
+            tmp = this->bins[idx];
+            while (tmp != nullptr && tmp->size < size)
+            {
+                tmp = tmp->free_next;
+            }
+        }
+        if (tmp == nullptr)
+        {
+            idx = this->nextNonEmptyBin(idx + 1);
+            if (idx < 0)
+            {
+                return nullptr;
+            }
+            tmp = this->bins[idx];
+        }
+        this->removeFreeBlock(tmp);
+        return tmp;
     }
-
     void insertFreeBlock(MallocMetadata* meta)
     {
-        MallocMetadata* tmp = this->free_list_head;
+        int idx = binIndex(meta->size);
+        MallocMetadata* tmp = this->bins[idx];
         MallocMetadata* prev = nullptr;
         while (tmp != nullptr && tmp->size < meta->size)
         {
@@ -516,7 +520,8 @@ public:
         }
         else
         {
-            this->free_list_head = meta;
+            this->bins[idx] = meta;
+            this->binmap[idx / 64] |= (uint64_t)1 << (idx % 64);
         }
         meta->free_next = tmp;
         if (tmp != nullptr)
@@ -524,6 +529,28 @@ public:
             tmp->free_prev = meta;
         }
     }
+    void removeFreeBlock(MallocMetadata* meta)
+    {
+        if (meta->free_prev != nullptr)
+        {
+            meta->free_prev->free_next = meta->free_next;
+        }
+        else
+        {
+            int idx = binIndex(meta->size);
+            this->bins[idx] = meta->free_next;
+            if (meta->free_next == nullptr)
+            {
+                this->binmap[idx / 64] &= ~((uint64_t)1 << (idx % 64));
+            }
+        }
+        if (meta->free_next != nullptr)
+        {
+            meta->free_next->free_prev = meta->free_prev;
+        }
+        meta->free_next = nullptr;
+        meta->free_prev = nullptr;
+    }
     size_t getAllocBytes()
     {
         return this->alloc_bytes;
@@ -649,6 +676,17 @@ void* srealloc(void* oldp, size_t size)
     MallocList& m_list = MallocList::getInstance();
     MallocMetadata* old_meta_data = m_list.getBlock(oldp);
     MallocMetadata* result = nullptr;
+    if (old_meta_data->is_mmap != (size >= MMAP_THREASHOLD)) //moves between the heap and a mapping
+    {
+        result = allocateBlock(size);
+        if (result == nullptr)
+        {
+            return nullptr;
+        }
+        memmove(result->p, oldp, (size < old_meta_data->size) ? size : old_meta_data->size);
+        m_list.freeBlock(oldp);
+        return result->p;
+    }
     if (size  >= MMAP_THREASHOLD)
     {
         result = m_list.reallocateBigBlock(old_meta_data, size);
@@ -1,685 +1,4434 @@
 #include <unistd.h>
-#include <iostream>
 #include <cstring>
 #include <sys/mman.h>
+#include <pthread.h>
+#include <sched.h>
+#include <atomic>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <cstdio>
+#include <cstdarg>
+#include <cmath>
+#include <algorithm>
+#include <unwind.h>
+#include <signal.h>
+#include <cassert>
 
 #define INITIAL_MMAP_THREASHOLD 128*1024
+#define DEFAULT_MMAP_THRESHOLD_MAX 32*1024*1024 // freed mappings raise the threshold up to this
+#define DEFAULT_MMAP_DECAY_MS 1000 // the raise halves after this long without a new one, 0 keeps it
+#define MMAP_DECAY_CHECK 256 // big or heap allocations of an arena between two clock reads
+#ifndef MALLOC_ALIGNMENT
+#ifdef MALLOC_PRELOAD
+#define MALLOC_ALIGNMENT 16 // what the C library's malloc guarantees
+#else
+#define MALLOC_ALIGNMENT 8 // payload alignment, 8 or 16
+#endif
+#endif
+#ifndef MAX_REQUEST_SIZE
+#ifdef MALLOC_PRELOAD
+#define MAX_REQUEST_SIZE ((size_t)1 << 40)
+#else
+#define MAX_REQUEST_SIZE 1e8
+#endif
+#endif
+#define NUM_BINS 128 // exact bins, one per 8 bytes, bigger free blocks go to the FreeTree
+#define SMALL_BIN_LIMIT (NUM_BINS * 8)
+#define BINMAP_WORDS ((NUM_BINS + 63) / 64)
+#define TLSF_SL_SHIFT 4 // define MALLOC_TLSF to index free blocks with TlsfIndex instead of BinIndex
+#define TLSF_SL_COUNT (1 << TLSF_SL_SHIFT)
+#define TLSF_SMALL_SHIFT (TLSF_SL_SHIFT + 3)
+#define TLSF_SMALL_SIZE (1 << TLSF_SMALL_SHIFT)
+#define TLSF_FL_COUNT (64 - TLSF_SMALL_SHIFT + 1)
 #define HUGE_SCALLOC 1024*1024*2
 #define HUGE_SMALLOC 1024*1024*4
+#define HUGE_PAGE_SIZE (1024*1024*2)
+#define TCACHE_MAX_SIZE 1024 // biggest block kept in the per thread caches
+#define TCACHE_BINS (TCACHE_MAX_SIZE / 8)
+#define TCACHE_COUNT 16 // max cached blocks per size
+#define TCACHE_BATCH 8 // blocks moved per refill or flush
+#define FAST_BIN_MAX_SIZE 4096 // freed heap blocks up to this size wait uncoalesced in fast bins
+#define FAST_BINS (FAST_BIN_MAX_SIZE / 8)
+#define DEFAULT_FAST_BYTES 256*1024 // fast bin bytes of an arena before they are consolidated
+#define FAST_CONSOLIDATE_SIZE 64*1024 // or once a free leaves a free block this big
+#define MAX_ARENAS 64 // NUM_ARENAS may be defined to override the number of cpus
+#define ARENA_HEAP_SIZE 64*1024*1024 // address space reserved by every arena but the main one
+#define HEAP_CHUNK_SIZE 1024*1024 // first sbrk growth of the main heap, doubled on every growth
+#define HEAP_CHUNK_MAX 32*1024*1024
+#define DEFAULT_TOP_PAD 128*1024 // extra bytes asked from sbrk on top of what is needed
+#define DEFAULT_TRIM_THRESHOLD 128*1024 // free bytes at the top of the heap before it is shrunk
+#define RELEASE_INTERIOR_MIN 128*1024 // free heap blocks this big give their inner pages back
+#define RELEASE_INTERIOR_BATCH 64*1024 // once this many bytes were freed into them
+#define PURGE_MIN_SIZE 8*1024 // free heap blocks this big wait in the purge queue of the background thread
+#define DEFAULT_CONSOLIDATE_INTERVAL 10 // background thread tasks, milliseconds between two rounds
+#define DEFAULT_CONSOLIDATE_BUDGET 256 // fast bin blocks per arena and round
+#define DEFAULT_DIRTY_DECAY 10000 // milliseconds free pages stay dirty before they are purged
+#define DEFAULT_PURGE_INTERVAL 100
+#define DEFAULT_PURGE_BUDGET 16*1024*1024 // bytes per arena and round
+#define DEFAULT_TRIM_INTERVAL 100
+#define DEFAULT_TRIM_BUDGET 16*1024*1024 // bytes per arena and round
+#define BACKGROUND_MAX_SLEEP 1000 // milliseconds, so new intervals are seen
+#define SM_TOP_PAD 1 // smallopt parameters
+#define SM_HEAP_CHUNK 2
+#define SM_TRIM_THRESHOLD 3
+#define SM_MMAP_THRESHOLD_MAX 4
+#define SM_MMAP_DECAY 5 // milliseconds
+#define SM_FAST_BYTES 6 // 0 turns the fast bins off
+#define SM_CONSOLIDATE_INTERVAL 7 // background thread tasks, an interval of 0 turns one off
+#define SM_CONSOLIDATE_BUDGET 8
+#define SM_DIRTY_DECAY 9
+#define SM_PURGE_INTERVAL 10
+#define SM_PURGE_BUDGET 11
+#define SM_TRIM_INTERVAL 12
+#define SM_TRIM_BUDGET 13
+#define SLAB_MAX_SIZE 256 // biggest size served from slabs, multiple of 8
+#define SLAB_CLASSES (SLAB_MAX_SIZE / 8)
+#define SLAB_SIZE 4096
+#define SLAB_REGION_SIZE 1024*1024*1024UL // address space reserved for all slabs
+#define SLAB_MAP_WORDS (SLAB_SIZE / 8 / 64) // enough bits for the smallest slots
+#define MAP_CACHE_BUCKETS 32 // one per power of two of pages
+#define MAP_CACHE_MAX_SIZE 16*1024*1024 // bigger mappings are never cached
+#define MAP_CACHE_MAX_BYTES 64*1024*1024
+#define MAP_CACHE_MAX_ENTRIES 64
+#define MAP_CACHE_MAX_AGE 1000000000L // nanoseconds a mapping may stay in the cache
+#define MAP_CACHE_CHECK 256 // heap frees of an arena between two looks at the age of the cache
+#define BUDDY_OFF 0
+#define BUDDY_POW2 1 // power of two requests go to the BuddyAllocator
+#define BUDDY_ALL 2 // every request it can hold goes to the BuddyAllocator
+#ifndef BUDDY_POLICY
+#define BUDDY_POLICY BUDDY_OFF
+#endif
+#define BUDDY_MIN_ORDER 12
+#define BUDDY_MAX_ORDER 26
+#define BUDDY_REGION_SIZE 1024*1024*1024UL
+#define BUDDY_FREE 0x80 // set in orders[] for the first unit of a free block
+#define TRACE_MAGIC 0x4352544d // "MTRC"
+#define TRACE_VERSION 1
+#define TRACE_DEFAULT_RECORDS 1024*1024
+#define TRACE_MALLOC 1 // TraceRecord ops
+#define TRACE_CALLOC 2
+#define TRACE_FREE 3
+#define TRACE_REALLOC 4 // old_ptr is the block that was resized
+#define TRACE_ALIGNED 5 // old_ptr is the alignment
+#define TRACE_SIZE_BITS 48
+#define TRACE_THREAD_BITS 12
+#define STATS_VERSION 3 // layout of SmallocStats
+#define STATS_FREE_BUCKETS 48 // bucket i counts free heap blocks of [2^i, 2^(i+1)) bytes
+#define SM_STATS_TEXT 0 // smalloc_stats_dump formats
+#define SM_STATS_JSON 1
+#define PROFILE_DEFAULT_RATE 512*1024 // mean bytes allocated between two samples
+#define PROFILE_BUCKETS (1 << 16) // hash chains of live samples, a power of two
+#define PROFILE_MAX_SAMPLES (1 << 14) // live samples kept, further ones are dropped
+#define PROFILE_MAX_DEPTH 30 // frames kept per sample
+#define PROFILE_INNER_FRAMES 4 // frames of the allocator itself unwound above its caller
+#define BLOCK_FREE 1
+#define BLOCK_PREV_FREE 2 // the block right below is free, its size is in the word before this header
+#define BLOCK_MMAP 4
+#define BLOCK_FLAGS 7
+#define ARENA_SHIFT 56 // the arena index is kept in the top byte of the header
+#define BLOCK_SIZE_MASK ((((size_t)1 << ARENA_SHIFT) - 1) & ~(size_t)BLOCK_FLAGS)
+#define MIN_BLOCK_SIZE (2 * sizeof(void*) + sizeof(size_t)) // free list links and boundary tag
 
 size_t align (size_t size);
-void* Sbrk(size_t size)
-{
-    void* p = sbrk(0);
-    if (p == (void*)(-1))
+
+//tunables, set with smallopt
+typedef struct malloc_options_t {
+    size_t top_pad;
+    size_t heap_chunk;
+    size_t trim_threshold;
+    size_t mmap_threshold_max;
+    size_t mmap_decay_ms;
+    size_t fast_bytes;
+    size_t consolidate_interval; // see BackgroundThread
+    size_t consolidate_budget;
+    size_t dirty_decay;
+    size_t purge_interval;
+    size_t purge_budget;
+    size_t trim_interval;
+    size_t trim_budget;
+}MallocOptions;
+
+//set by smallopt while other threads run, every field is read and written
+//with __atomic builtins
+MallocOptions options = {DEFAULT_TOP_PAD, HEAP_CHUNK_SIZE, DEFAULT_TRIM_THRESHOLD, DEFAULT_MMAP_THRESHOLD_MAX, DEFAULT_MMAP_DECAY_MS, DEFAULT_FAST_BYTES,
+                         DEFAULT_CONSOLIDATE_INTERVAL, DEFAULT_CONSOLIDATE_BUDGET, DEFAULT_DIRTY_DECAY,
+                         DEFAULT_PURGE_INTERVAL, DEFAULT_PURGE_BUDGET, DEFAULT_TRIM_INTERVAL, DEFAULT_TRIM_BUDGET};
+
+//snapshot filled by smalloc_stats. new fields are only added at the end,
+//with a new STATS_VERSION. the first five are what the _num_ functions return.
+typedef struct smalloc_stats_t {
+    uint32_t version;
+    uint32_t num_arenas;
+    size_t allocated_blocks; // free & used, slots and blocks in thread caches are used
+    size_t allocated_bytes;
+    size_t free_blocks; // fast bins included
+    size_t free_bytes;
+    size_t meta_data_bytes;
+    size_t heap_bytes; // heap blocks, free & used, without headers
+    size_t heap_free_bytes;
+    size_t heap_unused_bytes; // reserved by the heaps but not carved into blocks yet
+    size_t mmapped_blocks;
+    size_t mmapped_bytes;
+    size_t slab_bytes; // slots, free & used
+    size_t buddy_bytes; // free & used
+    size_t map_cache_bytes; // freed mappings kept for reuse
+    size_t largest_free_block; // of the heaps
+    double fragmentation; // 1 - largest_free_block / heap_free_bytes
+    size_t mmap_threshold; // of the main arena
+    size_t trim_threshold;
+    size_t splits; // cumulative
+    size_t merges;
+    size_t heap_extensions; // blocks carved from the top of a heap, or the wilderness grown
+    size_t heap_growths; // sbrk calls and arena heap reservations
+    size_t mmap_calls; // mappings made for big blocks
+    size_t class_slabs[SLAB_CLASSES]; // slabs of slot size 8 * (i + 1)
+    size_t class_used_slots[SLAB_CLASSES];
+    size_t free_histogram[STATS_FREE_BUCKETS];
+    size_t fast_blocks; // version 2: freed heap blocks waiting in fast bins
+    size_t fast_bytes;
+    size_t purged_bytes; // version 3: cumulative, given back from inside free heap blocks
+}SmallocStats;
+
+//one word in front of every block: payload size, arena and BLOCK_ flags.
+//a free block keeps its free list links at the start of its payload and
+//its size (the boundary tag) in the last word of its payload.
+typedef struct  malloc_meta_data_t{
+    size_t info;
+    //the owning arena flips BLOCK_PREV_FREE under its lock while the
+    //thread holding the block may read its size without it, so the word
+    //is accessed atomically (plain loads and stores on x86-64)
+    size_t load()
     {
-        return nullptr;
+        return __atomic_load_n(&this->info, __ATOMIC_RELAXED);
     }
-    unsigned long base = (unsigned long)p;
-    if(base % 8 != 0)
+    void store(size_t info)
     {
-        p = sbrk(8 - base % 8);
-        if (p == (void*)(-1))
-        {
-            return nullptr;
-        }
+        __atomic_store_n(&this->info, info, __ATOMIC_RELAXED);
     }
-    p = sbrk(size);
-    if (p == (void*)(-1))
+    size_t size()
     {
-        return nullptr;
+        return this->load() & BLOCK_SIZE_MASK;
+    }
+    void setSize(size_t size)
+    {
+        this->store((this->load() & ~BLOCK_SIZE_MASK) | size);
+    }
+    bool is(size_t flag)
+    {
+        return (this->load() & flag) != 0;
+    }
+    void set(size_t flag)
+    {
+        this->store(this->load() | flag);
+    }
+    void clear(size_t flag)
+    {
+        this->store(this->load() & ~flag);
+    }
+    bool isFree()
+    {
+        return this->is(BLOCK_FREE);
+    }
+    bool isMmap()
+    {
+        return this->is(BLOCK_MMAP);
+    }
+    int arena()
+    {
+        return this->load() >> ARENA_SHIFT;
+    }
+    void* p()
+    {
+        return this + 1;
+    }
+    //block right above this one, the caller checks this is not the wilderness
+    malloc_meta_data_t* next()
+    {
+        return (malloc_meta_data_t*)((char*)this->p() + this->size());
+    }
+    //block right below this one, only valid if BLOCK_PREV_FREE is set
+    malloc_meta_data_t* prev()
+    {
+        size_t prev_size = ((size_t*)this)[-1];
+        return (malloc_meta_data_t*)((char*)this - prev_size) - 1;
+    }
+    void writeFooter()
+    {
+        ((size_t*)this->next())[-1] = this->size();
+    }
+    malloc_meta_data_t*& freeNext()
+    {
+        return ((malloc_meta_data_t**)this->p())[0];
+    }
+    malloc_meta_data_t*& freePrev()
+    {
+        return ((malloc_meta_data_t**)this->p())[1];
+    }
+    //free blocks of the FreeTree use the same words as tree links
+    malloc_meta_data_t*& treeLeft()
+    {
+        return ((malloc_meta_data_t**)this->p())[0];
+    }
+    malloc_meta_data_t*& treeRight()
+    {
+        return ((malloc_meta_data_t**)this->p())[1];
+    }
+    size_t& treeHeight()
+    {
+        return ((size_t*)this->p())[2];
+    }
+    //free blocks of at least 5 words: bytes freed into the block since
+    //its pages were last given back
+    size_t& freeUnreleased()
+    {
+        return ((size_t*)this->p())[3];
+    }
+    //free blocks of at least PURGE_MIN_SIZE: links of the purge queue and
+    //when the block joined it, 0 if it is not queued
+    malloc_meta_data_t*& purgeNext()
+    {
+        return ((malloc_meta_data_t**)this->p())[4];
+    }
+    malloc_meta_data_t*& purgePrev()
+    {
+        return ((malloc_meta_data_t**)this->p())[5];
+    }
+    long& purgeStamp()
+    {
+        return ((long*)this->p())[6];
     }
-    return p;
-}
-typedef struct  malloc_meta_data_t{
-    size_t size;
-    bool is_free;
-    void* p;
-    bool is_mmap;
-    bool is_scalloc;
-    malloc_meta_data_t* lower;
-    malloc_meta_data_t* higher;
-    malloc_meta_data_t* free_next;
-    malloc_meta_data_t* free_prev;
 }MallocMetadata;
 
-class MallocList {
-    size_t free_blocks;
-    size_t alloc_blocks; //free & used
-    size_t free_bytes;
-    size_t alloc_bytes; //free & used
-    MallocMetadata* free_list_head;//  free list
-    MallocMetadata* mmaped_list_head;
-    MallocMetadata* wilderness;// end of all blocks list
-    
-    size_t mmap_threshold;
-
-public:
-    MallocList()
+//intrusive AVL tree of free blocks of at least SMALL_BIN_LIMIT bytes, ordered by size then address
+class FreeTree {
+    MallocMetadata* root;
+    static bool less(MallocMetadata* a, MallocMetadata* b)
     {
-        this->free_blocks = 0;
-        this->alloc_blocks = 0;
-        this->free_bytes = 0;
-        this->alloc_bytes = 0;
-        this->free_list_head = nullptr;
-        this->wilderness = nullptr;
-        this->mmaped_list_head = nullptr;
-        this->mmap_threshold = INITIAL_MMAP_THREASHOLD;
+        return a->size() < b->size() || (a->size() == b->size() && a < b);
     }
-    size_t getMmapThreshold()
+    static size_t height(MallocMetadata* node)
     {
-        return this->mmap_threshold;
+        return (node == nullptr) ? 0 : node->treeHeight();
     }
-    void updateBusyBlock(MallocMetadata* md)
+    static void fixHeight(MallocMetadata* node)
     {
-        if (md != nullptr)
-        {
-            md->is_free = false;
-            md->free_next = nullptr;
-            md->free_prev = nullptr;
-            md->is_mmap = false;
-        }
+        size_t left = height(node->treeLeft());
+        size_t right = height(node->treeRight());
+        node->treeHeight() = 1 + ((left > right) ? left : right);
+    }
+    static MallocMetadata* rotateRight(MallocMetadata* node)
+    {
+        MallocMetadata* left = node->treeLeft();
+        node->treeLeft() = left->treeRight();
+        left->treeRight() = node;
+        fixHeight(node);
+        fixHeight(left);
+        return left;
     }
-    //update all pointers to null and is_free <- false
-    void updateNewBlock(MallocMetadata* md)
+    static MallocMetadata* rotateLeft(MallocMetadata* node)
     {
-        if (md != nullptr) 
+        MallocMetadata* right = node->treeRight();
+        node->treeRight() = right->treeLeft();
+        right->treeLeft() = node;
+        fixHeight(node);
+        fixHeight(right);
+        return right;
+    }
+    static MallocMetadata* balance(MallocMetadata* node)
+    {
+        fixHeight(node);
+        size_t left = height(node->treeLeft());
+        size_t right = height(node->treeRight());
+        if (left > right + 1)
+        {
+            MallocMetadata* child = node->treeLeft();
+            if (height(child->treeRight()) > height(child->treeLeft()))
+            {
+                node->treeLeft() = rotateLeft(child);
+            }
+            return rotateRight(node);
+        }
+        if (right > left + 1)
         {
-            md->is_free = false;
-            md->lower = nullptr;
-            md->higher = nullptr;
-            md->free_next = nullptr;
-            md->free_prev = nullptr;
-            md->is_mmap = false;
+            MallocMetadata* child = node->treeRight();
+            if (height(child->treeLeft()) > height(child->treeRight()))
+            {
+                node->treeRight() = rotateRight(child);
+            }
+            return rotateLeft(node);
         }
+        return node;
     }
-    static MallocList& getInstance() // make MallocList singleton
+    static MallocMetadata* insert(MallocMetadata* node, MallocMetadata* md)
     {
-        static MallocList instance; // Guaranteed to be destroyed.
-        // Instantiated on first use.
-        return instance;
-    }
-    MallocMetadata* split(MallocMetadata* old_md, size_t size)
-    {       
-        MallocMetadata* new_free_md = (MallocMetadata*)((char*)old_md->p + size);
-        new_free_md->size = old_md->size - size - sizeof(MallocMetadata);
-        new_free_md->lower = old_md;
-        new_free_md->higher = old_md->higher;
-        new_free_md->p = (char*)old_md->p + size + sizeof(MallocMetadata);
-        new_free_md->is_mmap = false;
-        if (old_md->higher != nullptr)
+        if (node == nullptr)
+        {
+            md->treeLeft() = nullptr;
+            md->treeRight() = nullptr;
+            md->treeHeight() = 1;
+            return md;
+        }
+        if (less(md, node))
         {
-            old_md->higher->lower = new_free_md;
+            node->treeLeft() = insert(node->treeLeft(), md);
         }
         else
         {
-            this->wilderness = new_free_md;
+            node->treeRight() = insert(node->treeRight(), md);
         }
-        old_md->higher = new_free_md;
-        old_md->is_free = false;
-        old_md->size = size;
-        this->alloc_blocks++;
-        this->alloc_bytes -= sizeof(MallocMetadata);
-        this->freeBlock(new_free_md->p); //inserting new free block to free list
-        
-        return old_md; //newly allocated block
+        return balance(node);
     }
-    MallocMetadata* mergeAdjBlocks (MallocMetadata* low, MallocMetadata* high, bool is_free)
+    //unlinks the minimum of the subtree into *min
+    static MallocMetadata* removeMin(MallocMetadata* node, MallocMetadata** min)
     {
-        this->free_blocks--;
-        this->alloc_blocks--;
-        this->alloc_bytes += sizeof(MallocMetadata);
-        low->size += high->size + sizeof(MallocMetadata);
-        low->higher = high->higher;
-        if(high->higher != nullptr)
+        if (node->treeLeft() == nullptr)
         {
-            (high->higher)->lower = low;
+            *min = node;
+            return node->treeRight();
         }
-        if (this->wilderness == high)
+        node->treeLeft() = removeMin(node->treeLeft(), min);
+        return balance(node);
+    }
+    static MallocMetadata* remove(MallocMetadata* node, MallocMetadata* md)
+    {
+        if (node == md)
         {
-            this->wilderness = low;
-        }
-        if (!is_free)
-        {   
-            this->free_bytes -= (low->size - sizeof(MallocMetadata));
-            if(low->free_prev != nullptr)
+            MallocMetadata* left = md->treeLeft();
+            MallocMetadata* right = md->treeRight();
+            if (right == nullptr)
             {
-                low->free_prev->free_next = low->free_next;
+                return left;
             }
-            if(low->free_next != nullptr)
-            {
-                low->free_next->free_prev = low->free_prev;
-            }
-            this->updateBusyBlock(low);
-            return low;
+            MallocMetadata* min = nullptr;
+            right = removeMin(right, &min);
+            min->treeLeft() = left;
+            min->treeRight() = right;
+            return balance(min);
         }
-        //is_free:
-        if(high == this->free_list_head)
+        if (less(md, node))
         {
-            this->free_list_head = low;
+            node->treeLeft() = remove(node->treeLeft(), md);
         }
-        this->free_bytes += sizeof(MallocMetadata);
-        if (this->alloc_blocks == 1)
+        else
         {
-            low->free_next = nullptr;
-            low->free_prev = nullptr;
-            return low;
+            node->treeRight() = remove(node->treeRight(), md);
         }
-        if (low->free_next == nullptr && low->free_prev == nullptr)
+        return balance(node);
+    }
+public:
+    FreeTree()
+    {
+        this->root = nullptr;
+    }
+    void insert(MallocMetadata* md)
+    {
+        this->root = insert(this->root, md);
+    }
+    void remove(MallocMetadata* md)
+    {
+        this->root = remove(this->root, md);
+    }
+    //best fit: smallest block of at least size bytes, lowest address among equal sizes
+    MallocMetadata* lowerBound(size_t size)
+    {
+        MallocMetadata* best = nullptr;
+        MallocMetadata* node = this->root;
+        while (node != nullptr)
         {
-            low->free_next = high->free_next;
-            low->free_prev = high->free_prev;
-            if (high->free_prev != nullptr)
+            if (node->size() >= size)
             {
-                (high->free_prev)->free_next = low;
+                best = node;
+                node = node->treeLeft();
             }
-            if (high->free_next != nullptr)
+            else
             {
-                (high->free_next)->free_prev = low;
+                node = node->treeRight();
             }
-            return low;
         }
-        if (low->free_next == nullptr )
+        return best;
+    }
+    MallocMetadata* last()
+    {
+        MallocMetadata* node = this->root;
+        while (node != nullptr && node->treeRight() != nullptr)
+        {
+            node = node->treeRight();
+        }
+        return node;
+    }
+};
+
+//exact bins for small free blocks and a FreeTree for the rest, gives the best fit
+class BinIndex {
+    MallocMetadata* bins[NUM_BINS];// free lists of small blocks by size, each sorted by address
+    uint64_t binmap[BINMAP_WORDS];// bit i is set <=> bins[i] is not empty
+    FreeTree large_blocks;// free blocks of SMALL_BIN_LIMIT bytes and more
+public:
+    BinIndex()
+    {
+        for (int i = 0; i < NUM_BINS; i++)
         {
-            return low;
+            this->bins[i] = nullptr;
         }
-        if (low->free_next->size < low->size || 
-        (low->free_next->size == low->size && low->free_next->p < low->p))
+        for (int i = 0; i < BINMAP_WORDS; i++)
         {
-            (low->free_next)->free_prev = low->free_prev;
-            if (low->free_prev != nullptr)
-            {
-                (low->free_prev)->free_next = low->free_next;
-            }
-            MallocMetadata* tmp = low->free_next;
-            while(tmp->free_next != nullptr && tmp->size < low->size)
-            {
-                tmp = tmp->free_next;
-            }
-            if ((tmp->size > low->size) || (tmp->size == low->size && tmp->p < low->p))
-            {
-                tmp = tmp->free_prev;
-            }
-            //tmp ---> low ---> (tmp->free_next)
-            if (tmp->free_next != nullptr)
+            this->binmap[i] = 0;
+        }
+    }
+    static int binIndex(size_t size)
+    {
+        return size >> 3;
+    }
+    //first non empty bin with index >= from, -1 if there is none
+    int nextNonEmptyBin(int from)
+    {
+        int word = from / 64;
+        if (word >= BINMAP_WORDS)
+        {
+            return -1;
+        }
+        uint64_t bits = this->binmap[word] & (~(uint64_t)0 << (from % 64));
+        while (bits == 0)
+        {
+            word++;
+            if (word == BINMAP_WORDS)
             {
-                tmp->free_next->free_prev = tmp;
+                return -1;
             }
-            low->free_next = tmp->free_next;
-            tmp->free_next = low;
-            low->free_prev = tmp;
+            bits = this->binmap[word];
         }
-        return low;
+        return word * 64 + __builtin_ctzll(bits);
     }
-    MallocMetadata* unionWilderness(size_t size)
+    //best fit: smallest block that fits, lowest address among equal sizes.
+    //a small bin holds one size, and every block in the tree is bigger than
+    //every block in the bins.
+    MallocMetadata* take(size_t size)
     {
-        size_t new_space = size - this->wilderness->size;
-        void* p = Sbrk(new_space);
-        if (p == nullptr)
+        MallocMetadata* tmp = nullptr;
+        if (size < SMALL_BIN_LIMIT)
         {
-            return nullptr;
+            int idx = this->nextNonEmptyBin(binIndex(size));
+            if (idx >= 0)
+            {
+                tmp = this->bins[idx];
+            }
         }
-        this->wilderness->size = size;
-        this->alloc_bytes += new_space;
-        return this->wilderness;
+        if (tmp == nullptr)
+        {
+            tmp = this->large_blocks.lowerBound(size);
+            if (tmp == nullptr)
+            {
+                return nullptr;
+            }
+        }
+        this->remove(tmp);
+        return tmp;
     }
-    void insertBigBlock (MallocMetadata* meta_data)
+    void insert(MallocMetadata* meta)
     {
-        if (meta_data == nullptr)
+        if (meta->size() >= SMALL_BIN_LIMIT)
         {
+            this->large_blocks.insert(meta);
             return;
         }
-        meta_data->is_mmap = true;
-        this->alloc_blocks ++;
-        this->alloc_bytes += meta_data->size;
-        MallocMetadata* curr = this->mmaped_list_head;
+        int idx = binIndex(meta->size());
+        MallocMetadata* tmp = this->bins[idx];
         MallocMetadata* prev = nullptr;
-        while (curr != nullptr && curr->p < meta_data->p)
+        while(tmp != nullptr && tmp < meta)
         {
-            prev = curr;
-            curr = curr->higher;
+            prev = tmp;
+            tmp = tmp->freeNext();
         }
-        meta_data->higher = curr;
-        meta_data->lower = prev;
-        if (prev == nullptr)
+        meta->freePrev() = prev;
+        if (prev != nullptr)
         {
-            this->mmaped_list_head = meta_data;
+            prev->freeNext() = meta;
         }
         else
         {
-            prev->higher = meta_data;
+            this->bins[idx] = meta;
+            this->binmap[idx / 64] |= (uint64_t)1 << (idx % 64);
         }
-        if (curr != nullptr)
+        meta->freeNext() = tmp;
+        if (tmp != nullptr)
         {
-            curr->lower = meta_data;
+            tmp->freePrev() = meta;
         }
     }
-    // lower and  higher = null
-    // free_next and free_prev = null, already allocated , is_free = false, not mmapped
-    void insertNewAllocatedBlock (MallocMetadata* meta_data) 
+    void remove(MallocMetadata* meta)
     {
-        if (meta_data == nullptr)
+        if (meta->size() >= SMALL_BIN_LIMIT)
         {
+            this->large_blocks.remove(meta);
             return;
         }
-        if (this->wilderness == nullptr)
+        MallocMetadata* next = meta->freeNext();
+        MallocMetadata* prev = meta->freePrev();
+        if (prev != nullptr)
         {
-            this->wilderness = meta_data;
+            prev->freeNext() = next;
         }
         else
         {
-            this->wilderness->higher = meta_data;
-            meta_data->lower = this->wilderness;
-            this->wilderness = meta_data;
+            int idx = binIndex(meta->size());
+            this->bins[idx] = next;
+            if (next == nullptr)
+            {
+                this->binmap[idx / 64] &= ~((uint64_t)1 << (idx % 64));
+            }
         }
-        this->alloc_blocks ++;
-        this->alloc_bytes += meta_data->size;
-    }
-    MallocMetadata* reallocateBigBlock (MallocMetadata* md, size_t size)
-    {
-        if (md == nullptr)
+        if (next != nullptr)
         {
-            return nullptr;
+            next->freePrev() = prev;
         }
-        if (md->size == size)
+    }
+    size_t largest()
+    {
+        MallocMetadata* md = this->large_blocks.last();
+        if (md != nullptr)
         {
-            return md;
+            return md->size();
         }
-        size_t move_size = (size < md->size) ? size : md->size;
-        bool is_scalloc = (md == nullptr) ? false : md->is_scalloc;
-        MallocMetadata* new_md = this->allocateBigBlock(size, is_scalloc);
-        if (new_md != nullptr)
+        for (int word = BINMAP_WORDS - 1; word >= 0; word--)
         {
-            memmove(new_md->p, md->p, move_size);    
-            //after success we free oldp
-            this->freeBigBlock(md);
+            if (this->binmap[word] != 0)
+            {
+                return (word * 64 + 63 - __builtin_clzll(this->binmap[word])) * 8;
+            }
         }
-        return new_md;
+        return 0;
     }
-    MallocMetadata* reallocateBlock (MallocMetadata* md, size_t size)
+};
+
+//two level segregated fit: constant time good fit, free lists are LIFO
+class TlsfIndex {
+    uint64_t fl_map; // bit f is set <=> sl_map[f] is not 0
+    uint32_t sl_map[TLSF_FL_COUNT]; // bit s of sl_map[f] is set <=> blocks[f][s] is not empty
+    MallocMetadata* blocks[TLSF_FL_COUNT][TLSF_SL_COUNT];
+    //first level is the power of two, second level splits it in TLSF_SL_COUNT parts.
+    //below TLSF_SMALL_SIZE the second level is linear, 8 bytes per list.
+    static void mapping(size_t size, int* fl, int* sl)
     {
-        if (md == nullptr)
+        if (size < TLSF_SMALL_SIZE)
         {
-            return nullptr;
+            *fl = 0;
+            *sl = size / 8;
+            return;
         }
-        if (md->size >= size)
+        int msb = 63 - __builtin_clzl(size);
+        *fl = msb - TLSF_SMALL_SHIFT + 1;
+        *sl = (size >> (msb - TLSF_SL_SHIFT)) ^ TLSF_SL_COUNT;
+    }
+public:
+    TlsfIndex()
+    {
+        this->fl_map = 0;
+        for (int f = 0; f < TLSF_FL_COUNT; f++)
         {
-            if (md->size >= 128 + sizeof(MallocMetadata) + size)
+            this->sl_map[f] = 0;
+            for (int i = 0; i < TLSF_SL_COUNT; i++)
             {
-                return split(md, size);
+                this->blocks[f][i] = nullptr;
             }
-            return md;
         }
-        size_t oldsize = md->size;
-        void* oldp = md->p;
-        MallocMetadata* merged = md;
-        bool merge_with_lower = md->lower != nullptr && md->lower->is_free;
-        bool merge_with_higher = (md->higher != nullptr && md->higher->is_free) && (md->size + md->higher->size >= size);
-        if (merge_with_lower && ((md->size + md->lower->size >= size) || !merge_with_higher)) //mrege with lower
+    }
+    //head of the first non empty list whose every block has at least size bytes
+    MallocMetadata* take(size_t size)
+    {
+        if (size >= TLSF_SMALL_SIZE)
         {
-            if (this->free_list_head == md->lower)
-            {
-                this->free_list_head = md->lower->free_next;
-            }
-            this->free_bytes += md->size;
-            merged = this->mergeAdjBlocks(md->lower, md, false);
-            if (merged->size >= size)
-            {
-                return copyAndSplit(merged, size, oldp, oldsize);
-            }
+            //round up to the next list boundary
+            size += ((size_t)1 << (63 - __builtin_clzl(size) - TLSF_SL_SHIFT)) - 1;
         }
-        if (merged->higher != nullptr && merged->higher->is_free) //merge with higher
+        int fl, sl;
+        mapping(size, &fl, &sl);
+        if (fl >= TLSF_FL_COUNT)
         {
-            if (this->free_list_head == merged->higher)
+            return nullptr;
+        }
+        uint32_t sl_bits = this->sl_map[fl] & (~(uint32_t)0 << sl);
+        if (sl_bits == 0)
+        {
+            uint64_t fl_bits = (fl + 1 < 64) ? this->fl_map & (~(uint64_t)0 << (fl + 1)) : 0;
+            if (fl_bits == 0)
             {
-                this->free_list_head = merged->higher->free_next;
+                return nullptr;
             }
-            this->free_bytes += merged->size;
-            merged = this->mergeAdjBlocks(merged, merged->higher, false);
+            fl = __builtin_ctzll(fl_bits);
+            sl_bits = this->sl_map[fl];
         }
-        if (merged->size >= size)
+        sl = __builtin_ctz(sl_bits);
+        MallocMetadata* md = this->blocks[fl][sl];
+        this->remove(md);
+        return md;
+    }
+    void insert(MallocMetadata* meta)
+    {
+        int fl, sl;
+        mapping(meta->size(), &fl, &sl);
+        MallocMetadata* head = this->blocks[fl][sl];
+        meta->freePrev() = nullptr;
+        meta->freeNext() = head;
+        if (head != nullptr)
         {
-            return copyAndSplit (merged, size, oldp, oldsize);
+            head->freePrev() = meta;
         }
-        if (merged->higher == nullptr) //enlarge wilderness
+        this->blocks[fl][sl] = meta;
+        this->sl_map[fl] |= (uint32_t)1 << sl;
+        this->fl_map |= (uint64_t)1 << fl;
+    }
+    void remove(MallocMetadata* meta)
+    {
+        MallocMetadata* next = meta->freeNext();
+        MallocMetadata* prev = meta->freePrev();
+        if (next != nullptr)
         {
-            this->unionWilderness(size);
+            next->freePrev() = prev;
         }
-        if (merged->size >= size)
+        if (prev != nullptr)
         {
-            return copyAndSplit(merged, size, oldp, oldsize);
+            prev->freeNext() = next;
+            return;
         }
-        else //find other block
+        int fl, sl;
+        mapping(meta->size(), &fl, &sl);
+        this->blocks[fl][sl] = next;
+        if (next == nullptr)
         {
-            MallocMetadata* new_md = this->findFreeBlock(size);
-            memmove(new_md->p, oldp, oldsize);    
-            //after success we free oldp
-            this->freeBlock(merged->p);
-            return new_md;
+            this->sl_map[fl] &= ~((uint32_t)1 << sl);
+            if (this->sl_map[fl] == 0)
+            {
+                this->fl_map &= ~((uint64_t)1 << fl);
+            }
         }
     }
-    MallocMetadata* copyAndSplit (MallocMetadata* md, size_t size, void* oldp, size_t oldsize)
+    //the highest list is not sorted, it is walked
+    size_t largest()
     {
-        if (oldp != md->p)
+        if (this->fl_map == 0)
         {
-            memmove(md->p, oldp, oldsize);
+            return 0;
         }
-        if (md->size >= 128 + sizeof(MallocMetadata) + size)
+        int fl = 63 - __builtin_clzll(this->fl_map);
+        int sl = 31 - __builtin_clz(this->sl_map[fl]);
+        size_t max = 0;
+        for (MallocMetadata* md = this->blocks[fl][sl]; md != nullptr; md = md->freeNext())
         {
-            return split(md, size);
+            max = (md->size() > max) ? md->size() : max;
         }
-        return md;
+        return max;
     }
-    
-    MallocMetadata* allocateBigBlock(size_t size, bool is_scalloc)
+};
+
+#ifdef MALLOC_TLSF
+typedef TlsfIndex FreeIndex;
+#else
+typedef BinIndex FreeIndex;
+#endif
+
+//mapped blocks start with this, their MallocMetadata word follows it
+typedef struct big_block_t {
+    big_block_t* lower; // mmaped list, newest first
+    big_block_t* higher;
+    unsigned int pages; // length of the whole mapping, it starts at the page holding this
+    bool is_scalloc;
+    bool is_huge; // MAP_HUGETLB mappings are never cached
+    bool is_thp; // the payload was mapped HUGE_PAGE_SIZE aligned for transparent huge pages
+}BigBlock;
+
+//a page of equal sized slots without per slot headers
+typedef struct slab_t {
+    slab_t* next; // partial slabs of the same size and arena
+    slab_t* prev;
+    unsigned short slot_size;
+    unsigned short num_slots;
+    unsigned short num_free;
+    unsigned char arena;
+    uint64_t free_map[SLAB_MAP_WORDS]; // bit i is set <=> slot i is free
+}Slab;
+
+#define SLAB_HEADER_SIZE ((sizeof(Slab) + 15) & ~(size_t)15)
+
+//hands out slab pages from one reserved region, so a pointer is a slot iff it is in the region
+class SlabPool {
+    char* base;
+    char* top; // first page that was never handed out
+    char* end;
+    Slab* free_slabs; // returned pages, linked by next
+    pthread_mutex_t mutex;
+public:
+    SlabPool()
     {
-        int flags = MAP_ANONYMOUS | MAP_PRIVATE;
-        if (size >= HUGE_SMALLOC || (size >= HUGE_SCALLOC && is_scalloc))
-        {
-            flags = flags | MAP_HUGETLB;
-        }
-        void* p = mmap(nullptr, size + sizeof(MallocMetadata), PROT_READ | PROT_WRITE, flags, -1, 0);
+        pthread_mutex_init(&this->mutex, nullptr);
+        this->free_slabs = nullptr;
+        void* p = mmap(nullptr, SLAB_REGION_SIZE, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE | MAP_NORESERVE, -1, 0);
         if (p == (void*)(-1))
         {
-            std::cout<<"HELLO";
-            return nullptr;
+            p = nullptr;
         }
-        MallocMetadata* new_md = (MallocMetadata*)p;
-        new_md->size = size;
-        new_md->p = (void*)((MallocMetadata*)p + 1);
-        this->updateNewBlock(new_md);
-        this->insertBigBlock(new_md); //inside new_md->is_mmap = true
-        new_md->is_scalloc = is_scalloc;
-        return new_md;
+        this->base = (char*)p;
+        this->top = (char*)p;
+        this->end = (p == nullptr) ? nullptr : (char*)p + SLAB_REGION_SIZE;
     }
-
-    MallocMetadata* findFreeBlock (size_t size)
+    static SlabPool& getInstance() // make SlabPool singleton
+    {
+        static SlabPool instance;
+        return instance;
+    }
+    void lock()
+    {
+        pthread_mutex_lock(&this->mutex);
+    }
+    void unlock()
+    {
+        pthread_mutex_unlock(&this->mutex);
+    }
+    bool contains(void* p)
+    {
+        return (char*)p >= this->base && (char*)p < this->end;
+    }
+    static Slab* slabOf(void* p)
+    {
+        return (Slab*)((uintptr_t)p & ~(uintptr_t)(SLAB_SIZE - 1));
+    }
+    Slab* getSlab()
     {
-        MallocMetadata* tmp = this->free_list_head;
-        while (tmp != nullptr && tmp->size < size )
+        pthread_mutex_lock(&this->mutex);
+        Slab* slab = this->free_slabs;
+        if (slab != nullptr)
         {
-            tmp = tmp->free_next;
+            this->free_slabs = slab->next;
         }
-        if (tmp == nullptr)
+        else if (this->top < this->end)
+        {
+            slab = (Slab*)this->top;
+            this->top += SLAB_SIZE;
+        }
+        pthread_mutex_unlock(&this->mutex);
+        return slab;
+    }
+    void putSlab(Slab* slab)
+    {
+        madvise(slab, SLAB_SIZE, MADV_DONTNEED);
+        pthread_mutex_lock(&this->mutex);
+        slab->next = this->free_slabs;
+        this->free_slabs = slab;
+        pthread_mutex_unlock(&this->mutex);
+    }
+};
+
+//a freed mapping waiting in the MapCache, written at its start
+typedef struct cached_map_t {
+    cached_map_t* next; // same bucket
+    cached_map_t* prev;
+    cached_map_t* newer; // all entries, by age
+    cached_map_t* older;
+    size_t length;
+    long stamp; // when it was freed
+}CachedMap;
+
+//freed mappings kept for reuse instead of munmap, bounded in bytes,
+//entries and age. a mapping is only reused for a request that fits in it
+//with at most a quarter of it to spare.
+class MapCache {
+    CachedMap* buckets[MAP_CACHE_BUCKETS];
+    CachedMap* newest;
+    CachedMap* oldest;
+    size_t bytes;
+    std::atomic<size_t> entries; // read without the lock by expire
+    pthread_mutex_t mutex;
+    static long now()
+    {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec * 1000000000L + ts.tv_nsec;
+    }
+    static int bucketOf(size_t length)
+    {
+        int b = 63 - __builtin_clzl(length / getpagesize());
+        return (b < MAP_CACHE_BUCKETS) ? b : MAP_CACHE_BUCKETS - 1;
+    }
+    void unlink(CachedMap* entry)
+    {
+        if (entry->prev != nullptr)
+        {
+            entry->prev->next = entry->next;
+        }
+        else
+        {
+            this->buckets[bucketOf(entry->length)] = entry->next;
+        }
+        if (entry->next != nullptr)
+        {
+            entry->next->prev = entry->prev;
+        }
+        if (entry->newer != nullptr)
+        {
+            entry->newer->older = entry->older;
+        }
+        else
+        {
+            this->newest = entry->older;
+        }
+        if (entry->older != nullptr)
+        {
+            entry->older->newer = entry->newer;
+        }
+        else
+        {
+            this->oldest = entry->newer;
+        }
+        this->bytes -= entry->length;
+        this->entries--;
+    }
+    //unmap the oldest entries until the cache is within its bounds
+    void evict(long stamp)
+    {
+        while (this->oldest != nullptr && (this->bytes > MAP_CACHE_MAX_BYTES || this->entries > MAP_CACHE_MAX_ENTRIES ||
+               stamp - this->oldest->stamp > MAP_CACHE_MAX_AGE))
+        {
+            CachedMap* entry = this->oldest;
+            this->unlink(entry);
+            munmap(entry, entry->length);
+        }
+    }
+public:
+    MapCache()
+    {
+        pthread_mutex_init(&this->mutex, nullptr);
+        for (int i = 0; i < MAP_CACHE_BUCKETS; i++)
+        {
+            this->buckets[i] = nullptr;
+        }
+        this->newest = nullptr;
+        this->oldest = nullptr;
+        this->bytes = 0;
+        this->entries = 0;
+    }
+    static MapCache& getInstance() // make MapCache singleton
+    {
+        static MapCache instance;
+        return instance;
+    }
+    size_t getBytes()
+    {
+        return this->bytes;
+    }
+    void lock()
+    {
+        pthread_mutex_lock(&this->mutex);
+    }
+    void unlock()
+    {
+        pthread_mutex_unlock(&this->mutex);
+    }
+    //unmap the entries older than MAP_CACHE_MAX_AGE without waiting for the
+    //next get or put, which may never come. free of heap blocks and the
+    //background thread call it, it takes no lock when the cache is empty.
+    void expire()
+    {
+        if (this->entries.load(std::memory_order_relaxed) == 0)
+        {
+            return;
+        }
+        pthread_mutex_lock(&this->mutex);
+        this->evict(now());
+        pthread_mutex_unlock(&this->mutex);
+    }
+    //a cached mapping of at least *length bytes, *length is set to its real length
+    void* get(size_t* length)
+    {
+        size_t need = *length;
+        pthread_mutex_lock(&this->mutex);
+        this->evict(now());
+        CachedMap* found = nullptr;
+        for (int b = bucketOf(need); b < MAP_CACHE_BUCKETS && b <= bucketOf(need) + 1 && found == nullptr; b++)
+        {
+            for (CachedMap* entry = this->buckets[b]; entry != nullptr; entry = entry->next)
+            {
+                if (entry->length >= need && entry->length - need <= entry->length / 4)
+                {
+                    found = entry;
+                    break;
+                }
+            }
+        }
+        if (found != nullptr)
+        {
+            this->unlink(found);
+            *length = found->length;
+        }
+        pthread_mutex_unlock(&this->mutex);
+        return found;
+    }
+    //keep a freed mapping, false if the caller should unmap it
+    bool put(void* p, size_t length)
+    {
+        if (length > MAP_CACHE_MAX_SIZE)
+        {
+            return false;
+        }
+        CachedMap* entry = (CachedMap*)p;
+        entry->length = length;
+        entry->stamp = now();
+        pthread_mutex_lock(&this->mutex);
+        int b = bucketOf(length);
+        entry->prev = nullptr;
+        entry->next = this->buckets[b];
+        if (entry->next != nullptr)
+        {
+            entry->next->prev = entry;
+        }
+        this->buckets[b] = entry;
+        entry->newer = nullptr;
+        entry->older = this->newest;
+        if (this->newest != nullptr)
+        {
+            this->newest->newer = entry;
+        }
+        else
+        {
+            this->oldest = entry;
+        }
+        this->newest = entry;
+        this->bytes += length;
+        this->entries++;
+        this->evict(entry->stamp);
+        pthread_mutex_unlock(&this->mutex);
+        return true;
+    }
+};
+
+typedef struct buddy_links_t {
+    buddy_links_t* next;
+    buddy_links_t* prev;
+}BuddyLinks;
+
+//binary buddy system over a reserved region, blocks of 2^k bytes with
+//BUDDY_MIN_ORDER <= k <= BUDDY_MAX_ORDER. a block's buddy is at offset ^ 2^k.
+//no headers: the order of every block is kept in a side table.
+class BuddyAllocator {
+    char* base;
+    char* top; // first BUDDY_MAX_ORDER block that was never handed out
+    char* end;
+    unsigned char* orders; // one entry per 2^BUDDY_MIN_ORDER bytes of the region
+    BuddyLinks* free_lists[BUDDY_MAX_ORDER + 1];
+    size_t free_blocks;
+    size_t alloc_blocks; //free & used
+    size_t free_bytes;
+    size_t alloc_bytes; //free & used
+    pthread_mutex_t mutex;
+    size_t unitOf(void* p)
+    {
+        return ((char*)p - this->base) >> BUDDY_MIN_ORDER;
+    }
+    void push(void* p, int order)
+    {
+        BuddyLinks* links = (BuddyLinks*)p;
+        links->prev = nullptr;
+        links->next = this->free_lists[order];
+        if (links->next != nullptr)
+        {
+            links->next->prev = links;
+        }
+        this->free_lists[order] = links;
+        this->orders[this->unitOf(p)] = order | BUDDY_FREE;
+        this->free_blocks++;
+        this->free_bytes += (size_t)1 << order;
+    }
+    void unlink(void* p, int order)
+    {
+        BuddyLinks* links = (BuddyLinks*)p;
+        if (links->prev != nullptr)
+        {
+            links->prev->next = links->next;
+        }
+        else
+        {
+            this->free_lists[order] = links->next;
+        }
+        if (links->next != nullptr)
+        {
+            links->next->prev = links->prev;
+        }
+        this->orders[this->unitOf(p)] = 0;
+        this->free_blocks--;
+        this->free_bytes -= (size_t)1 << order;
+    }
+public:
+    BuddyAllocator()
+    {
+        pthread_mutex_init(&this->mutex, nullptr);
+        this->free_blocks = 0;
+        this->alloc_blocks = 0;
+        this->free_bytes = 0;
+        this->alloc_bytes = 0;
+        for (int i = 0; i <= BUDDY_MAX_ORDER; i++)
+        {
+            this->free_lists[i] = nullptr;
+        }
+        void* p = mmap(nullptr, BUDDY_REGION_SIZE, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE | MAP_NORESERVE, -1, 0);
+        void* map = mmap(nullptr, BUDDY_REGION_SIZE >> BUDDY_MIN_ORDER, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE | MAP_NORESERVE, -1, 0);
+        if (p == (void*)(-1) || map == (void*)(-1))
+        {
+            p = nullptr;
+        }
+        this->base = (char*)p;
+        this->top = (char*)p;
+        this->end = (p == nullptr) ? nullptr : (char*)p + BUDDY_REGION_SIZE;
+        this->orders = (unsigned char*)map;
+    }
+    static BuddyAllocator& getInstance() // make BuddyAllocator singleton
+    {
+        static BuddyAllocator instance;
+        return instance;
+    }
+    //smallest order that holds size, or -1
+    static int orderOf(size_t size)
+    {
+        int order = (size <= 1) ? 0 : 64 - __builtin_clzl(size - 1);
+        if (order < BUDDY_MIN_ORDER)
+        {
+            order = BUDDY_MIN_ORDER;
+        }
+        return (order > BUDDY_MAX_ORDER) ? -1 : order;
+    }
+    //should a request of size bytes go here under BUDDY_POLICY
+    static bool wants(size_t size)
+    {
+        if (BUDDY_POLICY == BUDDY_OFF || size < ((size_t)1 << BUDDY_MIN_ORDER) || size > ((size_t)1 << BUDDY_MAX_ORDER))
+        {
+            return false;
+        }
+        return BUDDY_POLICY == BUDDY_ALL || (size & (size - 1)) == 0;
+    }
+    bool contains(void* p)
+    {
+        return (char*)p >= this->base && (char*)p < this->end;
+    }
+    size_t usableSize(void* p)
+    {
+        return (size_t)1 << (this->orders[this->unitOf(p)] & ~BUDDY_FREE);
+    }
+    void* allocate(size_t size)
+    {
+        int order = orderOf(size);
+        if (order < 0)
+        {
+            return nullptr;
+        }
+        pthread_mutex_lock(&this->mutex);
+        int k = order;
+        while (k <= BUDDY_MAX_ORDER && this->free_lists[k] == nullptr)
+        {
+            k++;
+        }
+        if (k > BUDDY_MAX_ORDER)
+        {
+            if (this->top == this->end)
+            {
+                pthread_mutex_unlock(&this->mutex);
+                return nullptr;
+            }
+            k = BUDDY_MAX_ORDER;
+            this->alloc_blocks++;
+            this->alloc_bytes += (size_t)1 << k;
+            this->push(this->top, k);
+            this->top += (size_t)1 << k;
+        }
+        char* block = (char*)this->free_lists[k];
+        this->unlink(block, k);
+        while (k > order) //split, the upper half stays free
+        {
+            k--;
+            this->alloc_blocks++;
+            this->push(block + ((size_t)1 << k), k);
+        }
+        this->orders[this->unitOf(block)] = order;
+        pthread_mutex_unlock(&this->mutex);
+        return block;
+    }
+    void free(void* p)
+    {
+        pthread_mutex_lock(&this->mutex);
+        size_t offset = (char*)p - this->base;
+        int k = this->orders[this->unitOf(p)];
+        while (k < BUDDY_MAX_ORDER)
+        {
+            size_t buddy = offset ^ ((size_t)1 << k);
+            if (this->orders[buddy >> BUDDY_MIN_ORDER] != (k | BUDDY_FREE))
+            {
+                break;
+            }
+            this->unlink(this->base + buddy, k);
+            this->orders[offset >> BUDDY_MIN_ORDER] = 0;
+            this->alloc_blocks--;
+            offset &= ~((size_t)1 << k);
+            k++;
+        }
+        this->push(this->base + offset, k);
+        pthread_mutex_unlock(&this->mutex);
+    }
+    size_t getAllocBytes()
+    {
+        return this->alloc_bytes;
+    }
+    size_t getFreeBytes ()
+    {
+        return this->free_bytes;
+    }
+    size_t getAllocBlocks()
+    {
+        return this->alloc_blocks;
+    }
+    size_t getFreeBlocks ()
+    {
+        return this->free_blocks;
+    }
+    size_t getMetaDataBytes() //orders[] lives outside the blocks
+    {
+        return 0;
+    }
+    void lock()
+    {
+        pthread_mutex_lock(&this->mutex);
+    }
+    void unlock()
+    {
+        pthread_mutex_unlock(&this->mutex);
+    }
+};
+
+class MallocList {
+    size_t free_blocks;
+    size_t alloc_blocks; //free & used
+    size_t free_bytes;
+    size_t alloc_bytes; //free & used
+    FreeIndex free_index;// free blocks of the heap
+    BigBlock* mmaped_list_head;
+    MallocMetadata* wilderness;// end of all blocks list
+    
+    size_t mmap_threshold;
+    long decay_stamp; // when mmap_threshold or the heap chunk last grew or decayed
+    int decay_countdown; // allocations until the clock is read, see getMmapThreshold
+    int expire_countdown; // heap frees until MapCache::expire
+    pthread_mutex_t mutex;
+    int index; // 0 is the main arena, it grows with sbrk
+    char* heap_top; // blocks are carved from [heap_top, heap_end) without a syscall
+    char* heap_end; // the main arena keeps one header of room above it for a fence
+    char* heap_clean; // the heap from max(heap_top, heap_clean) up is still zero from the kernel
+    char* last_fresh; // start of the zero part of the last range carved from the heap
+    size_t dirty_bytes; // payload bytes of the last block handed out that may not be zero
+    int heap_growths;
+    int chunk_doublings; // main heap growths that doubled heapChunk, they decay like mmap_threshold
+    std::atomic<void*> remote_frees; // payloads freed by other arenas' threads, linked by their first word
+    Slab* partial_slabs[SLAB_CLASSES]; // slabs with at least one free slot
+    size_t num_slabs;
+    size_t slab_slots; //free & used, included in alloc_blocks
+    size_t big_blocks;
+    size_t mapped_bytes; // payloads of big_blocks
+    bool no_hugetlb; // a MAP_HUGETLB mapping failed once
+    size_t splits; // statistics, see SmallocStats
+    size_t merges;
+    size_t heap_extensions;
+    size_t mmap_calls;
+    size_t class_slabs[SLAB_CLASSES];
+    size_t class_used_slots[SLAB_CLASSES];
+    size_t free_histogram[STATS_FREE_BUCKETS]; // blocks in free_index
+    MallocMetadata* fast_bins[FAST_BINS]; // exact sizes, linked by the first payload word
+    size_t fast_blocks; // counted in free_blocks too
+    size_t fast_bytes;
+    MallocMetadata* purge_head; // oldest first
+    MallocMetadata* purge_tail;
+    size_t purged_bytes;
+    bool trim_partial; // a trim stopped at its budget, the next ones go on below the trim threshold
+    static bool background; // the background thread trims and purges instead of sfree
+
+public:
+    MallocList()
+    {
+        static int next_index = 0; // arenas are only built by getArena, in order
+        this->index = next_index++;
+        this->heap_top = nullptr;
+        this->heap_end = nullptr;
+        this->heap_clean = nullptr;
+        this->last_fresh = nullptr;
+        this->dirty_bytes = 0;
+        this->heap_growths = 0;
+        this->chunk_doublings = 0;
+        this->remote_frees.store(nullptr, std::memory_order_relaxed);
+        for (int i = 0; i < SLAB_CLASSES; i++)
+        {
+            this->partial_slabs[i] = nullptr;
+            this->class_slabs[i] = 0;
+            this->class_used_slots[i] = 0;
+        }
+        for (int i = 0; i < STATS_FREE_BUCKETS; i++)
+        {
+            this->free_histogram[i] = 0;
+        }
+        for (int i = 0; i < FAST_BINS; i++)
+        {
+            this->fast_bins[i] = nullptr;
+        }
+        this->fast_blocks = 0;
+        this->fast_bytes = 0;
+        this->purge_head = nullptr;
+        this->purge_tail = nullptr;
+        this->purged_bytes = 0;
+        this->trim_partial = false;
+        this->num_slabs = 0;
+        this->slab_slots = 0;
+        this->big_blocks = 0;
+        this->mapped_bytes = 0;
+        this->no_hugetlb = false;
+        this->splits = 0;
+        this->merges = 0;
+        this->heap_extensions = 0;
+        this->mmap_calls = 0;
+        pthread_mutex_init(&this->mutex, nullptr);
+        this->free_blocks = 0;
+        this->alloc_blocks = 0;
+        this->free_bytes = 0;
+        this->alloc_bytes = 0;
+        this->wilderness = nullptr;
+        this->mmaped_list_head = nullptr;
+        this->mmap_threshold = INITIAL_MMAP_THREASHOLD;
+        this->decay_stamp = 0;
+        this->decay_countdown = MMAP_DECAY_CHECK;
+        this->expire_countdown = MAP_CACHE_CHECK;
+    }
+    static long now()
+    {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec * 1000000000L + ts.tv_nsec;
+    }
+    //caller holds the lock, the threshold decays as a side effect, the
+    //clock is read every MMAP_DECAY_CHECK calls
+    size_t getMmapThreshold()
+    {
+        if (--this->decay_countdown <= 0)
+        {
+            this->decay_countdown = MMAP_DECAY_CHECK;
+            if (this->decayThreshold(now()) && !isBackground()) //the wilderness may be over the new trim threshold
+            {
+                this->trimWilderness(~(size_t)0);
+            }
+        }
+        return this->mmap_threshold;
+    }
+    //like glibc, a freed mapping raises the threshold to its size (up to
+    //options.mmap_threshold_max), so a buffer that is allocated and freed
+    //over and over stays in the heap instead of being mapped every time.
+    //unlike glibc, the raise is not forever: the part above the initial
+    //threshold halves for every options.mmap_decay_ms without a new raise,
+    //and so does the sbrk chunk of the main heap. the trim threshold (see
+    //getTrimThreshold) comes down with both.
+    void raiseThreshold(size_t size)
+    {
+        if (size > this->mmap_threshold && size <= __atomic_load_n(&options.mmap_threshold_max, __ATOMIC_RELAXED))
+        {
+            this->mmap_threshold = size;
+            this->decay_stamp = now();
+        }
+    }
+    //returns true if the thresholds came down. besides allocations, trims
+    //run it first, so an arena that stopped allocating still decays.
+    bool decayThreshold(long time)
+    {
+        size_t decay_ms = __atomic_load_n(&options.mmap_decay_ms, __ATOMIC_RELAXED);
+        if ((this->mmap_threshold <= INITIAL_MMAP_THREASHOLD && this->chunk_doublings == 0) || decay_ms == 0)
+        {
+            return false;
+        }
+        long period = (long)decay_ms * 1000000L;
+        long periods = (time - this->decay_stamp) / period;
+        if (periods == 0)
+        {
+            return false;
+        }
+        if (this->mmap_threshold > INITIAL_MMAP_THREASHOLD)
+        {
+            size_t excess = this->mmap_threshold - INITIAL_MMAP_THREASHOLD;
+            this->mmap_threshold = INITIAL_MMAP_THREASHOLD + ((periods < 64) ? excess >> periods : 0);
+        }
+        this->chunk_doublings = (this->chunk_doublings > periods) ? this->chunk_doublings - periods : 0;
+        this->decay_stamp += periods * period;
+        return true;
+    }
+    //a trim that stopped at its budget is not resumed by the next one
+    void endPartialTrim()
+    {
+        this->trim_partial = false;
+    }
+    //the free wilderness leaves the free index to be trimmed. the purge
+    //queue is not ordered by size, so there it keeps its place and stamp
+    //unless the trim leaves it too small to be queued.
+    void trimWilderness(size_t budget)
+    {
+        if (this->wilderness != nullptr && this->wilderness->isFree())
+        {
+            MallocMetadata* top = this->wilderness;
+            bool queued = top->size() >= PURGE_MIN_SIZE && top->purgeStamp() != 0;
+            MallocMetadata* prev = queued ? top->purgePrev() : nullptr; //the links may be trimmed away
+            MallocMetadata* next = queued ? top->purgeNext() : nullptr;
+            this->free_histogram[histogramBucket(top->size())]--;
+            this->free_index.remove(top);
+            this->trimHeap(budget);
+            this->free_histogram[histogramBucket(top->size())]++;
+            this->free_index.insert(top);
+            if (queued && top->size() < PURGE_MIN_SIZE)
+            {
+                this->unlinkPurge(prev, next);
+            }
+        }
+    }
+    //like glibc, once big blocks are kept in the heap the heap is not
+    //trimmed below twice their size. twice the next sbrk chunk also keeps
+    //a trim from being undone by the very next growth.
+    size_t getTrimThreshold()
+    {
+        size_t dynamic = 2 * this->mmap_threshold;
+        if (this->isMainArena() && 2 * this->heapChunk() > dynamic)
+        {
+            dynamic = 2 * this->heapChunk();
+        }
+        size_t trim_threshold = __atomic_load_n(&options.trim_threshold, __ATOMIC_RELAXED);
+        return (trim_threshold > dynamic) ? trim_threshold : dynamic;
+    }
+    static BigBlock* bigOf(MallocMetadata* md)
+    {
+        return (BigBlock*)md - 1;
+    }
+    //start of the mapping, the headers of a hugepage aligned payload sit
+    //at the end of the page before it
+    static char* mappingOf(BigBlock* big)
+    {
+        return (char*)((size_t)big / getpagesize() * getpagesize());
+    }
+    //the block right above md, nullptr for the wilderness
+    MallocMetadata* higher(MallocMetadata* md)
+    {
+        return (md == this->wilderness) ? nullptr : md->next();
+    }
+    //the block right below md if it is free, nullptr otherwise
+    MallocMetadata* lowerFree(MallocMetadata* md)
+    {
+        return md->is(BLOCK_PREV_FREE) ? md->prev() : nullptr;
+    }
+    //is_free <- false, and tell the block above
+    void updateBusyBlock(MallocMetadata* md)
+    {
+        md->clear(BLOCK_FREE);
+        MallocMetadata* high = this->higher(md);
+        if (high != nullptr)
+        {
+            high->clear(BLOCK_PREV_FREE);
+        }
+    }
+    //is_free <- true, write the boundary tag and tell the block above
+    void updateFreeBlock(MallocMetadata* md)
+    {
+        md->set(BLOCK_FREE);
+        md->writeFooter();
+        MallocMetadata* high = this->higher(md);
+        if (high != nullptr)
+        {
+            high->set(BLOCK_PREV_FREE);
+        }
+    }
+    //busy block of this arena with no flags
+    void updateNewBlock(MallocMetadata* md, size_t size)
+    {
+        md->store(size | ((size_t)this->index << ARENA_SHIFT));
+    }
+    void lock()
+    {
+        pthread_mutex_lock(&this->mutex);
+    }
+    void unlock()
+    {
+        pthread_mutex_unlock(&this->mutex);
+    }
+    static int numArenas()
+    {
+#ifdef NUM_ARENAS
+        return NUM_ARENAS;
+#else
+        static int num = 0; //racing threads all compute the same value
+        int n = __atomic_load_n(&num, __ATOMIC_RELAXED);
+        if (n == 0)
+        {
+            long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+            n = (cpus < 1) ? 1 : (cpus > MAX_ARENAS) ? MAX_ARENAS : (int)cpus;
+            __atomic_store_n(&num, n, __ATOMIC_RELAXED);
+        }
+        return n;
+#endif
+    }
+    static MallocList& getArena(int i)
+    {
+        static MallocList arenas[MAX_ARENAS]; // Instantiated on first use.
+        return arenas[i];
+    }
+    //arena of the cpu we run on, or a hash of the thread if that is unknown
+    static MallocList& pickArena()
+    {
+        int cpu = sched_getcpu();
+        if (cpu >= 0)
+        {
+            return getArena(cpu % numArenas());
+        }
+        uint32_t hash = (uint32_t)((uintptr_t)pthread_self() >> 12) * 0x9E3779B1u;
+        return getArena((hash >> 16) % numArenas());
+    }
+    static bool isSlot(void* p)
+    {
+        return SlabPool::getInstance().contains(p);
+    }
+    static bool isBuddy(void* p)
+    {
+#if BUDDY_POLICY == BUDDY_OFF
+        (void)p;
+        return false;
+#else
+        return BuddyAllocator::getInstance().contains(p);
+#endif
+    }
+    //size of a heap block that holds size bytes. a block and the header
+    //after it fill whole MALLOC_ALIGNMENT units, so payloads stay aligned
+    //as blocks are split and merged.
+    static size_t blockSize(size_t size)
+    {
+        if (size < MIN_BLOCK_SIZE)
+        {
+            size = MIN_BLOCK_SIZE;
+        }
+        size_t units = (size + sizeof(MallocMetadata) + MALLOC_ALIGNMENT - 1) / MALLOC_ALIGNMENT;
+        return units * MALLOC_ALIGNMENT - sizeof(MallocMetadata);
+    }
+    //bytes the caller may use at p
+    static size_t usableSize(void* p)
+    {
+        if (isSlot(p))
+        {
+            return SlabPool::slabOf(p)->slot_size;
+        }
+        if (isBuddy(p))
+        {
+            return BuddyAllocator::getInstance().usableSize(p);
+        }
+        return ((MallocMetadata*)p - 1)->size();
+    }
+    static MallocList& ownerOf(void* p)
+    {
+        if (isSlot(p))
+        {
+            return getArena(SlabPool::slabOf(p)->arena);
+        }
+        return getArena(((MallocMetadata*)p - 1)->arena());
+    }
+    //lock free, safe to call without holding the lock
+    void pushRemoteFree(void* p)
+    {
+        void* head = this->remote_frees.load(std::memory_order_relaxed);
+        do
+        {
+            *(void**)p = head;
+        } while (!this->remote_frees.compare_exchange_weak(head, p, std::memory_order_release, std::memory_order_relaxed));
+    }
+    //free everything other threads pushed, caller holds the lock
+    void drainRemoteFrees()
+    {
+        if (this->remote_frees.load(std::memory_order_relaxed) == nullptr)
+        {
+            return;
+        }
+        void* tmp = this->remote_frees.exchange(nullptr, std::memory_order_acquire);
+        while (tmp != nullptr)
+        {
+            void* next = *(void**)tmp;
+            this->release(tmp);
+            tmp = next;
+        }
+    }
+    void initSlab(Slab* slab, size_t slot_size)
+    {
+        slab->next = nullptr;
+        slab->prev = nullptr;
+        slab->slot_size = slot_size;
+        slab->num_slots = (SLAB_SIZE - SLAB_HEADER_SIZE) / slot_size;
+        slab->num_free = slab->num_slots;
+        slab->arena = this->index;
+        for (int i = 0; i < SLAB_MAP_WORDS; i++)
+        {
+            int first = i * 64;
+            if (first + 64 <= slab->num_slots)
+            {
+                slab->free_map[i] = ~(uint64_t)0;
+            }
+            else if (first < slab->num_slots)
+            {
+                slab->free_map[i] = ((uint64_t)1 << (slab->num_slots - first)) - 1;
+            }
+            else
+            {
+                slab->free_map[i] = 0;
+            }
+        }
+        //every slot counts as a block, free until handed out
+        this->class_slabs[slot_size / 8 - 1]++;
+        this->num_slabs++;
+        this->slab_slots += slab->num_slots;
+        this->alloc_blocks += slab->num_slots;
+        this->free_blocks += slab->num_slots;
+        this->alloc_bytes += slab->num_slots * slot_size;
+        this->free_bytes += slab->num_slots * slot_size;
+    }
+    void linkSlab(Slab* slab)
+    {
+        int cls = slab->slot_size / 8 - 1;
+        slab->prev = nullptr;
+        slab->next = this->partial_slabs[cls];
+        if (slab->next != nullptr)
+        {
+            slab->next->prev = slab;
+        }
+        this->partial_slabs[cls] = slab;
+    }
+    void unlinkSlab(Slab* slab)
+    {
+        int cls = slab->slot_size / 8 - 1;
+        if (slab->prev != nullptr)
+        {
+            slab->prev->next = slab->next;
+        }
+        else
+        {
+            this->partial_slabs[cls] = slab->next;
+        }
+        if (slab->next != nullptr)
+        {
+            slab->next->prev = slab->prev;
+        }
+        slab->next = nullptr;
+        slab->prev = nullptr;
+    }
+    // size is aligned and at most SLAB_MAX_SIZE, nullptr if the slab region is used up
+    void* allocateSlot(size_t size)
+    {
+        int cls = size / 8 - 1;
+        Slab* slab = this->partial_slabs[cls];
+        if (slab == nullptr)
+        {
+            slab = SlabPool::getInstance().getSlab();
+            if (slab == nullptr)
+            {
+                return nullptr;
+            }
+            this->initSlab(slab, size);
+            this->linkSlab(slab);
+        }
+        int word = 0;
+        while (slab->free_map[word] == 0)
+        {
+            word++;
+        }
+        int bit = __builtin_ctzll(slab->free_map[word]);
+        slab->free_map[word] &= ~((uint64_t)1 << bit);
+        slab->num_free--;
+        this->class_used_slots[cls]++;
+        if (slab->num_free == 0)
+        {
+            this->unlinkSlab(slab);
+        }
+        this->free_blocks--;
+        this->free_bytes -= slab->slot_size;
+        return (char*)slab + SLAB_HEADER_SIZE + (word * 64 + bit) * slab->slot_size;
+    }
+    void freeSlot(void* p)
+    {
+        Slab* slab = SlabPool::slabOf(p);
+        int slot = ((char*)p - (char*)slab - SLAB_HEADER_SIZE) / slab->slot_size;
+        slab->free_map[slot / 64] |= (uint64_t)1 << (slot % 64);
+        if (slab->num_free == 0)
+        {
+            this->linkSlab(slab);
+        }
+        slab->num_free++;
+        this->class_used_slots[slab->slot_size / 8 - 1]--;
+        this->free_blocks++;
+        this->free_bytes += slab->slot_size;
+        bool only_partial = this->partial_slabs[slab->slot_size / 8 - 1] == slab && slab->next == nullptr;
+        if (slab->num_free == slab->num_slots && !only_partial) //keep one empty slab per size
+        {
+            this->unlinkSlab(slab);
+            this->class_slabs[slab->slot_size / 8 - 1]--;
+            this->num_slabs--;
+            this->slab_slots -= slab->num_slots;
+            this->alloc_blocks -= slab->num_slots;
+            this->free_blocks -= slab->num_slots;
+            this->alloc_bytes -= slab->num_slots * slab->slot_size;
+            this->free_bytes -= slab->num_slots * slab->slot_size;
+            SlabPool::getInstance().putSlab(slab);
+        }
+    }
+    //small allocation from this arena's slabs or heap, caller holds the lock
+    void* allocate(size_t size)
+    {
+        if (size <= SLAB_MAX_SIZE)
+        {
+            this->drainRemoteFrees();
+            void* p = this->allocateSlot(size);
+            if (p != nullptr)
+            {
+                return p;
+            }
+        }
+        MallocMetadata* md = this->findFreeBlock(size);
+        return (md == nullptr) ? nullptr : md->p();
+    }
+    //n blocks of size bytes into out, under one lock. heap blocks are cut
+    //from one big free block. returns how many were allocated.
+    size_t allocateBatch(size_t size, size_t n, void** out)
+    {
+        size_t done = 0;
+        if (size >= this->mmap_threshold)
+        {
+            for (; done < n; done++)
+            {
+                MallocMetadata* md = this->allocateBigBlock(size, false);
+                if (md == nullptr)
+                {
+                    break;
+                }
+                out[done] = md->p();
+            }
+            return done;
+        }
+        if (size <= SLAB_MAX_SIZE)
+        {
+            this->drainRemoteFrees();
+            for (; done < n; done++)
+            {
+                void* p = this->allocateSlot(size);
+                if (p == nullptr)
+                {
+                    break;
+                }
+                out[done] = p;
+            }
+            if (done == n)
+            {
+                return done;
+            }
+        }
+        size = blockSize(size);
+        MallocMetadata* md = this->findFreeBlock((n - done) * (size + sizeof(MallocMetadata)) - sizeof(MallocMetadata));
+        if (md == nullptr)
+        {
+            return done;
+        }
+        char* end = (char*)md->p() + md->size();
+        for (; done < n - 1; done++)
+        {
+            out[done] = md->p();
+            MallocMetadata* next = (MallocMetadata*)((char*)md->p() + size);
+            this->updateNewBlock(next, end - (char*)next->p());
+            if (md == this->wilderness)
+            {
+                this->wilderness = next;
+            }
+            md->setSize(size);
+            this->alloc_blocks++;
+            this->alloc_bytes -= sizeof(MallocMetadata);
+            this->splits++;
+            md = next;
+        }
+        out[done++] = md->p();
+        return done;
+    }
+    //free a slot or a block, caller holds the lock
+    void release(void* p)
+    {
+        if (isSlot(p))
+        {
+            this->freeSlot(p);
+            return;
+        }
+        if (--this->expire_countdown == 0)
+        {
+            this->expire_countdown = MAP_CACHE_CHECK;
+            MapCache::getInstance().expire();
+        }
+        if (!this->pushFastBlock((MallocMetadata*)p - 1))
+        {
+            MallocMetadata* md = this->freeBlock(p);
+            if (md != nullptr && this->fast_blocks > 0 && !isBackground() && (md->size() >= FAST_CONSOLIDATE_SIZE || md == this->wilderness))
+            {
+                this->consolidate(); //the top of the heap may come down now
+            }
+        }
+    }
+    //a small heap block that was freed is kept as it is, still marked busy
+    //so its neighbours do not merge with it, and handed out again on the
+    //next request of its exact size without a merge and a split. the
+    //wilderness and the block right below a free wilderness are not kept,
+    //so the top of the heap still grows down and is trimmed.
+    bool pushFastBlock(MallocMetadata* md)
+    {
+        size_t size = md->size();
+        if (size > FAST_BIN_MAX_SIZE || __atomic_load_n(&options.fast_bytes, __ATOMIC_RELAXED) == 0 || md->isMmap() || md == this->wilderness)
+        {
+            return false;
+        }
+        if (this->higher(md) == this->wilderness && this->wilderness->isFree())
+        {
+            return false;
+        }
+        int idx = size / 8 - 1;
+        *(MallocMetadata**)md->p() = this->fast_bins[idx];
+        this->fast_bins[idx] = md;
+        this->fast_blocks++;
+        this->fast_bytes += size;
+        this->free_blocks++;
+        this->free_bytes += size;
+        if (this->fast_bytes > __atomic_load_n(&options.fast_bytes, __ATOMIC_RELAXED))
+        {
+            this->consolidate();
+        }
+        return true;
+    }
+    // size is a blockSize
+    MallocMetadata* popFastBlock(size_t size)
+    {
+        if (size > FAST_BIN_MAX_SIZE || this->fast_blocks == 0)
+        {
+            return nullptr;
+        }
+        int idx = size / 8 - 1;
+        MallocMetadata* md = this->fast_bins[idx];
+        if (md != nullptr)
+        {
+            this->fast_bins[idx] = *(MallocMetadata**)md->p();
+            this->fast_blocks--;
+            this->fast_bytes -= size;
+            this->free_blocks--;
+            this->free_bytes -= size;
+        }
+        return md;
+    }
+    //free every block of the fast bins for real, merging it with its free
+    //neighbours. runs in one batch when a request finds no free block, or
+    //when the fast bins pass options.fast_bytes
+    void consolidate()
+    {
+        this->consolidate(this->fast_blocks);
+    }
+    //the same for up to budget blocks, smallest first
+    void consolidate(size_t budget)
+    {
+        for (int i = 0; i < FAST_BINS && budget > 0 && this->fast_blocks > 0; i++)
+        {
+            while (this->fast_bins[i] != nullptr && budget > 0)
+            {
+                MallocMetadata* md = this->fast_bins[i];
+                this->fast_bins[i] = *(MallocMetadata**)md->p();
+                this->fast_blocks--;
+                this->fast_bytes -= md->size();
+                this->free_blocks--;
+                this->free_bytes -= md->size();
+                this->freeBlock(md->p());
+                budget--;
+            }
+        }
+    }
+    static bool isBackground()
+    {
+        return __atomic_load_n(&background, __ATOMIC_RELAXED);
+    }
+    static void setBackground(bool on)
+    {
+        __atomic_store_n(&background, on, __ATOMIC_RELAXED);
+    }
+    bool isMainArena()
+    {
+        return this->index == 0;
+    }
+    //the next sbrk growth of the main heap
+    size_t heapChunk()
+    {
+        int shift = (this->chunk_doublings < 16) ? this->chunk_doublings : 16;
+        size_t heap_chunk = __atomic_load_n(&options.heap_chunk, __ATOMIC_RELAXED);
+        size_t chunk = heap_chunk << shift;
+        if (chunk > HEAP_CHUNK_MAX)
+        {
+            chunk = (heap_chunk > HEAP_CHUNK_MAX) ? heap_chunk : HEAP_CHUNK_MAX;
+        }
+        return chunk;
+    }
+    //make sure size bytes can be carved from the heap of this arena.
+    //the main arena sbrks chunks of at least options.heap_chunk bytes, doubling
+    //up to HEAP_CHUNK_MAX. if someone else moved the break, a new segment starts:
+    //the old one is closed with a busy fence header and the wilderness is dropped.
+    bool reserveHeap(size_t size)
+    {
+        if (size <= (size_t)(this->heap_end - this->heap_top))
+        {
+            return true;
+        }
+        if (!this->isMainArena())
+        {
+            if (this->heap_top != nullptr)
+            {
+                return false;
+            }
+            void* p = mmap(nullptr, ARENA_HEAP_SIZE, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE | MAP_NORESERVE, -1, 0);
+            if (p == (void*)(-1))
+            {
+                return false;
+            }
+            this->heap_growths++;
+            this->heap_top = (char*)p + MALLOC_ALIGNMENT - sizeof(MallocMetadata); //first payload aligned
+            this->heap_end = (char*)p + ARENA_HEAP_SIZE;
+            this->heap_clean = this->heap_top;
+            return size <= (size_t)(this->heap_end - this->heap_top);
+        }
+        char* brk = (char*)sbrk(0);
+        if (brk == (char*)(-1))
+        {
+            return false;
+        }
+        char* start = this->heap_top;
+        if (this->heap_top == nullptr || brk != this->heap_end + sizeof(MallocMetadata))
+        {
+            size_t first_payload = ((size_t)brk + sizeof(MallocMetadata) + MALLOC_ALIGNMENT - 1) / MALLOC_ALIGNMENT * MALLOC_ALIGNMENT;
+            start = (char*)(first_payload - sizeof(MallocMetadata));
+        }
+        size_t page = getpagesize();
+        size_t chunk = this->heapChunk();
+        size_t needed = start + size + sizeof(MallocMetadata) - brk;
+        size_t grow = needed + __atomic_load_n(&options.top_pad, __ATOMIC_RELAXED);
+        if (grow < chunk)
+        {
+            grow = chunk;
+        }
+        grow = ((size_t)brk + grow + page - 1) / page * page - (size_t)brk;
+        if (sbrk(grow) == (void*)(-1))
+        {
+            grow = needed;
+            if (sbrk(grow) == (void*)(-1))
+            {
+                return false;
+            }
+        }
+        if (start != this->heap_top)
+        {
+            if (this->heap_top != nullptr)
+            {
+                ((MallocMetadata*)this->heap_top)->store(0); //fence, a busy empty block
+                this->wilderness = nullptr;
+            }
+            this->heap_top = start;
+            this->heap_clean = start;
+        }
+        this->heap_end = brk + grow - sizeof(MallocMetadata);
+        this->heap_growths++;
+        this->chunk_doublings++;
+        this->decay_stamp = now();
+        return true;
+    }
+    //grow the heap of this arena by size bytes, like sbrk
+    void* extendHeap(size_t size)
+    {
+        if (!this->reserveHeap(size))
+        {
+            return nullptr;
+        }
+        this->heap_extensions++;
+        return this->carveHeap(size);
+    }
+    //hand out the next size bytes of the reserved heap
+    char* carveHeap(size_t size)
+    {
+        char* p = this->heap_top;
+        this->heap_top += size;
+        this->last_fresh = (this->heap_clean > p) ? this->heap_clean : p;
+        if (this->heap_clean < this->heap_top)
+        {
+            this->heap_clean = this->heap_top;
+        }
+        return p;
+    }
+    //payload bytes from p that may not be zero, p was just carved
+    size_t dirtyBytes(void* p, size_t size)
+    {
+        if (this->last_fresh <= (char*)p)
+        {
+            return 0;
+        }
+        size_t dirty = this->last_fresh - (char*)p;
+        return (dirty < size) ? dirty : size;
+    }
+    //fresh: false when the tail of old_md was free until now, see freeBlock
+    MallocMetadata* split(MallocMetadata* old_md, size_t size, bool fresh = true)
+    {       
+        MallocMetadata* new_free_md = (MallocMetadata*)((char*)old_md->p() + size);
+        this->updateNewBlock(new_free_md, old_md->size() - size - sizeof(MallocMetadata));
+        if (old_md == this->wilderness)
+        {
+            this->wilderness = new_free_md;
+        }
+        old_md->setSize(size);
+        old_md->clear(BLOCK_FREE);
+        this->splits++;
+        this->alloc_blocks++;
+        this->alloc_bytes -= sizeof(MallocMetadata);
+        this->freeBlock(new_free_md->p(), fresh ? new_free_md->size() + sizeof(MallocMetadata) : 0); //inserting new free block to free list
+        
+        return old_md; //newly allocated block
+    }
+    // low and high must already be out of the free lists.
+    // is_free: both blocks are free and so is the result, the caller inserts it.
+    // otherwise exactly one of them is free and the result is busy.
+    MallocMetadata* mergeAdjBlocks (MallocMetadata* low, MallocMetadata* high, bool is_free)
+    {
+        this->merges++;
+        this->free_blocks--;
+        this->alloc_blocks--;
+        this->alloc_bytes += sizeof(MallocMetadata);
+        if (is_free)
+        {
+            this->free_bytes += sizeof(MallocMetadata);
+        }
+        else
+        {
+            this->free_bytes -= low->isFree() ? low->size() : high->size();
+        }
+        low->setSize(low->size() + high->size() + sizeof(MallocMetadata));
+        if (this->wilderness == high)
+        {
+            this->wilderness = low;
+        }
+        if (is_free)
+        {
+            this->updateFreeBlock(low);
+        }
+        else
+        {
+            this->updateBusyBlock(low);
+        }
+        return low;
+    }
+    MallocMetadata* unionWilderness(size_t size)
+    {
+        MallocMetadata* wilderness = this->wilderness;
+        size_t new_space = size - wilderness->size();
+        if (!this->reserveHeap(new_space) || this->wilderness != wilderness)
+        {
+            return nullptr;
+        }
+        this->carveHeap(new_space);
+        this->heap_extensions++;
+        this->wilderness->setSize(size);
+        this->alloc_bytes += new_space;
+        return this->wilderness;
+    }
+    void insertBigBlock (MallocMetadata* meta_data)
+    {
+        if (meta_data == nullptr)
+        {
+            return;
+        }
+        meta_data->set(BLOCK_MMAP);
+        this->alloc_blocks ++;
+        this->alloc_bytes += meta_data->size();
+        this->mapped_bytes += meta_data->size();
+        this->big_blocks ++;
+        this->linkBigBlock(bigOf(meta_data));
+    }
+    void linkBigBlock(BigBlock* big)
+    {
+        big->lower = nullptr;
+        big->higher = this->mmaped_list_head;
+        if (big->higher != nullptr)
+        {
+            big->higher->lower = big;
+        }
+        this->mmaped_list_head = big;
+    }
+    // new busy block at the end of the heap
+    void insertNewAllocatedBlock (MallocMetadata* meta_data) 
+    {
+        if (meta_data == nullptr)
+        {
+            return;
+        }
+        if (this->wilderness != nullptr && this->wilderness->isFree())
+        {
+            meta_data->set(BLOCK_PREV_FREE);
+        }
+        this->wilderness = meta_data;
+        this->alloc_blocks ++;
+        this->alloc_bytes += meta_data->size();
+    }
+    //resize a mapping in place: shrinking unmaps the tail, growing lets the
+    //kernel move the pages (mremap) instead of copying them.
+    //nullptr if the kernel refused, the caller copies then.
+    MallocMetadata* remapBigBlock(MallocMetadata* md, size_t size)
+    {
+        BigBlock* big = bigOf(md);
+        char* start = mappingOf(big);
+        size_t page = big->is_huge ? HUGE_PAGE_SIZE : getpagesize();
+        size_t length = (size_t)big->pages * getpagesize();
+        size_t new_length = ((char*)md->p() - start + size + page - 1) / page * page;
+        if (new_length < length)
+        {
+            if (munmap(start + new_length, length - new_length) != 0)
+            {
+                return nullptr;
+            }
+        }
+        else if (new_length > length)
+        {
+            //a moved transparent huge page payload would lose its 2MB
+            //alignment, so it only grows in place. otherwise the caller
+            //copies it into a new aligned mapping.
+            this->unlinkBigBlock(big);
+            void* p = mremap(start, length, new_length, big->is_thp ? 0 : MREMAP_MAYMOVE);
+            if (p == (void*)(-1))
+            {
+                this->linkBigBlock(big);
+                return nullptr;
+            }
+            big = (BigBlock*)((char*)p + ((char*)big - start));
+            this->linkBigBlock(big);
+            md = (MallocMetadata*)(big + 1);
+        }
+        big->pages = new_length / getpagesize();
+        this->alloc_bytes += size;
+        this->alloc_bytes -= md->size();
+        this->mapped_bytes += size;
+        this->mapped_bytes -= md->size();
+        md->setSize(size);
+        return md;
+    }
+    MallocMetadata* reallocateBigBlock (MallocMetadata* md, size_t size)
+    {
+        if (md == nullptr)
+        {
+            return nullptr;
+        }
+        if (md->size() == size)
+        {
+            return md;
+        }
+        MallocMetadata* remapped = this->remapBigBlock(md, size);
+        if (remapped != nullptr)
+        {
+            return remapped;
+        }
+        size_t move_size = (size < md->size()) ? size : md->size();
+        bool is_scalloc = bigOf(md)->is_scalloc;
+        MallocMetadata* new_md = this->allocateBigBlock(size, is_scalloc);
+        if (new_md != nullptr)
+        {
+            memmove(new_md->p(), md->p(), move_size);    
+            //after success we free oldp
+            this->freeBigBlock(md);
+        }
+        return new_md;
+    }
+    MallocMetadata* reallocateBlock (MallocMetadata* md, size_t size)
+    {
+        if (md == nullptr)
+        {
+            return nullptr;
+        }
+        size = blockSize(size);
+        if (md->size() >= size)
+        {
+            if (md->size() >= 128 + sizeof(MallocMetadata) + size)
+            {
+                return split(md, size);
+            }
+            return md;
+        }
+        size_t oldsize = md->size();
+        void* oldp = md->p();
+        MallocMetadata* merged = md;
+        MallocMetadata* lower = this->lowerFree(md);
+        MallocMetadata* high = this->higher(md);
+        bool merge_with_lower = lower != nullptr;
+        bool merge_with_higher = (high != nullptr && high->isFree()) && (md->size() + high->size() >= size);
+        if (merge_with_lower && ((md->size() + lower->size() >= size) || !merge_with_higher)) //mrege with lower
+        {
+            this->removeFreeBlock(lower);
+            merged = this->mergeAdjBlocks(lower, md, false);
+            if (merged->size() >= size)
+            {
+                return copyAndSplit(merged, size, oldp, oldsize);
+            }
+        }
+        high = this->higher(merged);
+        if (high != nullptr && high->isFree()) //merge with higher
+        {
+            this->removeFreeBlock(high);
+            merged = this->mergeAdjBlocks(merged, high, false);
+        }
+        if (merged->size() >= size)
+        {
+            return copyAndSplit (merged, size, oldp, oldsize);
+        }
+        if (merged == this->wilderness) //enlarge wilderness
+        {
+            this->unionWilderness(size);
+        }
+        if (merged->size() >= size)
+        {
+            return copyAndSplit(merged, size, oldp, oldsize);
+        }
+        else //find other block
+        {
+            MallocMetadata* new_md = this->findFreeBlock(size);
+            if (new_md == nullptr && !this->isMainArena())
+            {
+                MallocList& main_arena = getArena(0);
+                main_arena.lock();
+                new_md = main_arena.findFreeBlock(size);
+                main_arena.unlock();
+            }
+            if (new_md == nullptr)
+            {
+                return nullptr;
+            }
+            memmove(new_md->p(), oldp, oldsize);    
+            //after success we free oldp, the free neighbours merged into it were counted before
+            this->freeBlock(merged->p(), oldsize + sizeof(MallocMetadata));
+            return new_md;
+        }
+    }
+    //md grew over free neighbours, which make up most of the split off tail
+    MallocMetadata* copyAndSplit (MallocMetadata* md, size_t size, void* oldp, size_t oldsize)
+    {
+        if (oldp != md->p())
+        {
+            memmove(md->p(), oldp, oldsize);
+        }
+        if (md->size() >= 128 + sizeof(MallocMetadata) + size)
+        {
+            return split(md, size, false);
+        }
+        return md;
+    }
+    
+    //fresh mapping whose payload of size bytes is aligned to alignment (a
+    //power of two), *length is set to the mapping length. when alignment
+    //is a page or more the headers sit at the end of the page before the payload.
+    static char* mapAligned(size_t size, size_t alignment, size_t* length)
+    {
+        size_t page = getpagesize();
+        size_t headers = sizeof(BigBlock) + sizeof(MallocMetadata);
+        size_t payload_length = (size + page - 1) / page * page;
+        if (alignment < page)
+        {
+            size_t lead = (headers + alignment - 1) / alignment * alignment;
+            *length = (lead + size + page - 1) / page * page;
+            char* p = (char*)mmap(nullptr, *length, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+            return (p == (char*)(-1)) ? nullptr : p + lead;
+        }
+        size_t raw_length = page + payload_length + alignment - page;
+        char* raw = (char*)mmap(nullptr, raw_length, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+        if (raw == (char*)(-1))
+        {
+            return nullptr;
+        }
+        char* payload = (char*)(((size_t)raw + page + alignment - 1) / alignment * alignment);
+        char* start = payload - page;
+        *length = page + payload_length;
+        if (start > raw)
+        {
+            munmap(raw, start - raw);
+        }
+        if (raw + raw_length > start + *length)
+        {
+            munmap(start + *length, raw + raw_length - (start + *length));
+        }
+        return payload;
+    }
+    //huge requests try, in order: hugetlb pages, a normal mapping with its
+    //payload 2MB aligned and MADV_HUGEPAGE (transparent huge pages), plain
+    //pages. a hugetlb mapping keeps its headers in its first huge page.
+    //alignment is 0 or a power of two the payload must be aligned to.
+    MallocMetadata* allocateBigBlock(size_t size, bool is_scalloc, size_t alignment = 0)
+    {
+        size_t headers = sizeof(BigBlock) + sizeof(MallocMetadata);
+        size_t page = getpagesize();
+        bool wants_huge = size >= HUGE_SMALLOC || (size >= HUGE_SCALLOC && is_scalloc);
+        bool is_huge = false;
+        bool is_thp = false;
+        size_t length = 0;
+        BigBlock* big = nullptr;
+        if (wants_huge && !this->no_hugetlb && alignment <= headers)
+        {
+            length = (size + headers + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+            void* p = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE | MAP_HUGETLB, -1, 0);
+            if (p != (void*)(-1))
+            {
+                big = (BigBlock*)p;
+                is_huge = true;
+                this->mmap_calls++;
+            }
+            else
+            {
+                this->no_hugetlb = true; //no reserved hugetlb pages, do not ask again
+            }
+        }
+        if (big == nullptr && wants_huge)
+        {
+            char* payload = mapAligned(size, (alignment > HUGE_PAGE_SIZE) ? alignment : HUGE_PAGE_SIZE, &length);
+            if (payload != nullptr)
+            {
+                madvise(payload, (size + page - 1) / page * page, MADV_HUGEPAGE);
+                big = (BigBlock*)(payload - headers);
+                is_thp = true;
+                this->mmap_calls++;
+            }
+        }
+        if (big == nullptr && alignment > headers)
+        {
+            char* payload = mapAligned(size, alignment, &length);
+            if (payload == nullptr)
+            {
+                return nullptr;
+            }
+            big = (BigBlock*)(payload - headers);
+            this->mmap_calls++;
+        }
+        this->dirty_bytes = 0; //fresh mappings are zero
+        if (big == nullptr)
+        {
+            length = (size + headers + page - 1) / page * page;
+            void* p = MapCache::getInstance().get(&length);
+            if (p != nullptr)
+            {
+                this->dirty_bytes = size;
+            }
+            else
+            {
+                p = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+                this->mmap_calls++;
+            }
+            if (p == (void*)(-1))
+            {
+                this->mmap_calls--;
+                return nullptr;
+            }
+            big = (BigBlock*)p;
+        }
+        big->pages = length / page;
+        big->is_scalloc = is_scalloc;
+        big->is_huge = is_huge;
+        big->is_thp = is_thp;
+        MallocMetadata* new_md = (MallocMetadata*)(big + 1);
+        this->updateNewBlock(new_md, size);
+        this->insertBigBlock(new_md);
+        return new_md;
+    }
+    //give the front of busy block md back to the free blocks so that its
+    //payload starts on a multiple of alignment. returns the new header.
+    MallocMetadata* alignBlock(MallocMetadata* md, size_t alignment)
+    {
+        if ((size_t)md->p() % alignment == 0)
+        {
+            return md;
+        }
+        size_t start = (size_t)md->p() + MIN_BLOCK_SIZE + sizeof(MallocMetadata);
+        char* payload = (char*)((start + alignment - 1) / alignment * alignment);
+        MallocMetadata* high = (MallocMetadata*)payload - 1;
+        size_t lead = (char*)high - (char*)md->p();
+        this->updateNewBlock(high, md->size() - lead - sizeof(MallocMetadata));
+        if (md == this->wilderness)
+        {
+            this->wilderness = high;
+        }
+        md->setSize(lead);
+        this->splits++;
+        this->alloc_blocks++;
+        this->alloc_bytes -= sizeof(MallocMetadata);
+        this->freeBlock(md->p()); //the leading slack goes back to the free list
+        return high;
+    }
+    //heap block (or mapping, for big ones) whose payload is aligned to alignment
+    MallocMetadata* allocateAligned(size_t size, size_t alignment)
+    {
+        size = blockSize(size);
+        if (size + alignment >= this->mmap_threshold)
+        {
+            return this->allocateBigBlock(size, false, alignment);
+        }
+        MallocMetadata* md = this->findFreeBlock(size + alignment + MIN_BLOCK_SIZE + sizeof(MallocMetadata));
+        if (md == nullptr)
+        {
+            return nullptr;
+        }
+        md = this->alignBlock(md, alignment);
+        if (md->size() >= 128 + sizeof(MallocMetadata) + size)
+        {
+            md = this->split(md, size);
+        }
+        return md;
+    }
+
+    MallocMetadata* findFreeBlock (size_t size)
+    {
+        this->drainRemoteFrees();
+        size = blockSize(size);
+        MallocMetadata* tmp = this->popFastBlock(size);
+        if (tmp != nullptr)
+        {
+            this->dirty_bytes = size;
+            return tmp;
+        }
+        tmp = this->takeFreeBlock(size);
+        if (tmp == nullptr && this->fast_blocks > 0)
+        {
+            this->consolidate();
+            tmp = this->takeFreeBlock(size);
+        }
+        if (tmp == nullptr)
         {
             //if there is no other free block return (if free) wilderness that is smaller than size
-            if (this->wilderness != nullptr && this->wilderness->is_free)
+            if (this->wilderness != nullptr && this->wilderness->isFree())
+            {
+                MallocMetadata* top = this->wilderness;
+                size_t old_size = top->size();
+                this->removeFreeBlock(top);
+                MallocMetadata* meta_ret = unionWilderness(size);
+                if (meta_ret != nullptr)
+                {
+                    this->dirty_bytes = old_size + this->dirtyBytes((char*)meta_ret->p() + old_size, size - old_size);
+                    this->updateBusyBlock(meta_ret);
+                    this->free_blocks --;
+                    this->free_bytes -= old_size;
+                    return meta_ret;
+                }
+                //sbrk failed, or the heap went on in a new segment
+                this->insertFreeBlock(top);
+            }
+            //allocate a new block if there is no free block available
+            void* p = this->extendHeap(size + sizeof(MallocMetadata));
+            if (p == nullptr)
+            {
+                return nullptr;
+            }
+            MallocMetadata* meta_data = (MallocMetadata*)p;
+            this->updateNewBlock(meta_data, size);
+            this->insertNewAllocatedBlock(meta_data);
+            this->dirty_bytes = this->dirtyBytes(meta_data->p(), size);
+            return meta_data;
+        }
+        else
+        {
+            //there is a block that is big enough
+            this->dirty_bytes = tmp->size();
+            this->updateBusyBlock(tmp);
+            this->free_blocks --;
+            this->free_bytes -= tmp->size();
+            if (tmp->size() >= 128 +  sizeof(MallocMetadata) + size)
+            {
+                return split(tmp, size, false);
+            }
+            return tmp;
+        }   
+    }
+
+    void unlinkBigBlock(BigBlock* big)
+    {
+        if (big->lower != nullptr) 
+        {
+            big->lower->higher = big->higher;
+        }
+        if (big->higher != nullptr)
+        {
+            big->higher->lower = big->lower;
+        }
+        if (this->mmaped_list_head == big)
+        {
+            this->mmaped_list_head = big->higher;
+        }
+    }
+    void freeBigBlock(MallocMetadata* tmp)
+    {
+        BigBlock* big = bigOf(tmp);
+        this->unlinkBigBlock(big);
+        this->alloc_bytes -= tmp->size();
+        this->mapped_bytes -= tmp->size();
+        this->alloc_blocks --;
+        this->big_blocks --;
+        this->raiseThreshold(tmp->size());
+        size_t length = (size_t)big->pages * getpagesize();
+        if (big->is_huge || !MapCache::getInstance().put(mappingOf(big), length))
+        {
+            munmap(mappingOf(big), length);
+        }
+    }
+
+    MallocMetadata* freeBlock (void * p)
+    {
+        if (p == nullptr)
+        {
+            return nullptr;
+        }
+        return this->freeBlock(p, ((MallocMetadata*)p - 1)->size() + sizeof(MallocMetadata));
+    }
+    //dirty: how many bytes of the block may be resident. less than its size
+    //when part of it was free (and counted) before, like the remainder of
+    //a free block that was split.
+    //returns the free block p ended in, nullptr for a big block
+    MallocMetadata* freeBlock (void * p, size_t dirty)
+    {
+        MallocMetadata* md = (MallocMetadata*)p - 1; 
+        if (md->isMmap())
+        {
+            this->freeBigBlock(md);
+            return nullptr;
+        }
+        this->updateFreeBlock(md);
+        this->free_blocks ++;
+        this->free_bytes += md->size();
+        size_t unreleased = dirty;
+        MallocMetadata* high = this->higher(md);
+        if (high != nullptr && high->isFree())
+        {
+            unreleased += unreleasedOf(high);
+            this->removeFreeBlock(high);
+            this->mergeAdjBlocks(md, high, true);
+        }
+        MallocMetadata* lower = this->lowerFree(md);
+        if (lower != nullptr)
+        {
+            unreleased += unreleasedOf(lower);
+            this->removeFreeBlock(lower);
+            md = this->mergeAdjBlocks(lower, md, true);
+        }
+        if (md == this->wilderness && !isBackground())
+        {
+            this->decayThreshold(now());
+            this->trimHeap(~(size_t)0);
+        }
+        this->releaseInterior(md, unreleased);
+        this->insertFreeBlock(md);
+        return md;
+    }
+    //the free wilderness and the unused tail of the heap above it are
+    //given back once they pass getTrimThreshold(), keeping
+    //options.top_pad bytes, and at most budget bytes at a time. the
+    //wilderness is out of the free index.
+    void trimHeap(size_t budget)
+    {
+        MallocMetadata* top = this->wilderness;
+        char* tail = (char*)top->p() + top->size();
+        char* keep = (char*)top->p() + blockSize(MIN_BLOCK_SIZE + __atomic_load_n(&options.top_pad, __ATOMIC_RELAXED));
+        size_t page = getpagesize();
+        bool resume = this->trim_partial && budget != ~(size_t)0; //only budgeted trims go on below the threshold
+        if (tail != this->heap_top)
+        {
+            return;
+        }
+        if (this->isMainArena())
+        {
+            if ((size_t)(this->heap_end - (char*)top->p()) <= this->getTrimThreshold() && !resume)
+            {
+                return;
+            }
+            char* brk = (char*)sbrk(0);
+            char* new_brk = (char*)(((size_t)keep + sizeof(MallocMetadata) + page - 1) / page * page);
+            bool partial = new_brk < brk && (size_t)(brk - new_brk) > budget;
+            if (partial)
+            {
+                new_brk = brk - budget / page * page;
+            }
+            if (brk != this->heap_end + sizeof(MallocMetadata) || new_brk + page > brk)
+            {
+                return; //the break is not ours or there is not a page to give back
+            }
+            if (sbrk(-(brk - new_brk)) == (void*)(-1))
+            {
+                return;
+            }
+            this->trim_partial = partial;
+            this->heap_end = new_brk - sizeof(MallocMetadata);
+            if (tail <= this->heap_end)
+            {
+                if (this->heap_clean > new_brk)
+                {
+                    this->heap_clean = new_brk;
+                }
+                return;
+            }
+            tail = this->heap_end;
+            this->heap_clean = new_brk; //the fence room was wilderness payload
+        }
+        else
+        {
+            //the reserved region stays mapped, its pages are dropped
+            char* start = (char*)(((size_t)keep + page - 1) / page * page);
+            bool partial = start < tail && (size_t)(tail - start) > budget;
+            if (partial)
+            {
+                start = (char*)(((size_t)tail - budget + page - 1) / page * page);
+            }
+            if (((size_t)(tail - (char*)top->p()) <= this->getTrimThreshold() && !resume) || start >= tail)
+            {
+                return;
+            }
+            madvise(start, tail - start, MADV_DONTNEED);
+            this->trim_partial = partial;
+            tail = partial ? start - sizeof(MallocMetadata) : keep; //like heap_end, the next header ends at a page
+            this->heap_clean = start;
+        }
+        size_t released = this->heap_top - tail;
+        top->setSize(top->size() - released);
+        assert(blockSize(top->size()) == top->size());
+        this->heap_top = tail;
+        this->free_bytes -= released;
+        this->alloc_bytes -= released;
+        this->updateFreeBlock(top);
+    }
+    static size_t unreleasedOf(MallocMetadata* md)
+    {
+        return (md->size() >= 5 * sizeof(size_t)) ? md->freeUnreleased() : md->size() + sizeof(MallocMetadata);
+    }
+    //drop the pages inside a big free block, its links, tree node, counter,
+    //purge queue links and boundary tag stay resident. this is batched: it
+    //happens once RELEASE_INTERIOR_BATCH bytes were freed into the block,
+    //not on every free that merges into it. blocks of the size the heap is
+    //recycling (see getTrimThreshold) keep their pages. while the
+    //background thread runs, it purges instead.
+    void releaseInterior(MallocMetadata* md, size_t unreleased)
+    {
+        if (md->size() < 5 * sizeof(size_t))
+        {
+            return;
+        }
+        if (unreleased >= RELEASE_INTERIOR_BATCH && md->size() >= RELEASE_INTERIOR_MIN && md->size() > 2 * this->mmap_threshold &&
+            !isBackground())
+        {
+            this->releasePages(md, unreleased);
+            unreleased = 0;
+        }
+        md->freeUnreleased() = unreleased;
+    }
+    //only how many bytes are dirty is known, not where: the whole interior
+    //is dropped but at most the unreleased bytes are counted as given back
+    size_t releasePages(MallocMetadata* md, size_t unreleased)
+    {
+        size_t page = getpagesize();
+        size_t start = ((size_t)md->p() + 7 * sizeof(size_t) + page - 1) / page * page;
+        size_t end = ((size_t)md->p() + md->size() - sizeof(size_t)) / page * page;
+        if (start >= end)
+        {
+            return 0;
+        }
+        madvise((void*)start, end - start, MADV_DONTNEED);
+        size_t released = (unreleased < end - start) ? unreleased : end - start;
+        this->purged_bytes += released;
+        return released;
+    }
+    //while the background thread runs, free blocks of at least
+    //PURGE_MIN_SIZE that had bytes freed into them wait here, in the order
+    //they were freed, until BackgroundThread purges them. a block leaves the
+    //queue with the free index.
+    void queuePurge(MallocMetadata* md)
+    {
+        md->purgeStamp() = 0;
+        if (!isBackground() || md->freeUnreleased() == 0)
+        {
+            return;
+        }
+        md->purgeStamp() = now();
+        md->purgeNext() = nullptr;
+        md->purgePrev() = this->purge_tail;
+        if (this->purge_tail != nullptr)
+        {
+            this->purge_tail->purgeNext() = md;
+        }
+        else
+        {
+            this->purge_head = md;
+        }
+        this->purge_tail = md;
+    }
+    void unqueuePurge(MallocMetadata* md)
+    {
+        if (md->purgeStamp() == 0)
+        {
+            return;
+        }
+        this->unlinkPurge(md->purgePrev(), md->purgeNext());
+        md->purgeStamp() = 0;
+    }
+    //take the block between prev and next out of the purge queue
+    void unlinkPurge(MallocMetadata* prev, MallocMetadata* next)
+    {
+        if (prev != nullptr)
+        {
+            prev->purgeNext() = next;
+        }
+        else
+        {
+            this->purge_head = next;
+        }
+        if (next != nullptr)
+        {
+            next->purgePrev() = prev;
+        }
+        else
+        {
+            this->purge_tail = prev;
+        }
+    }
+    //give back the pages of the blocks queued at least decay nanoseconds
+    //ago, oldest first, until budget bytes were given back
+    void purge(long decay, size_t budget)
+    {
+        long stamp = now() - decay;
+        size_t purged = 0;
+        while (this->purge_head != nullptr && purged < budget && this->purge_head->purgeStamp() <= stamp)
+        {
+            MallocMetadata* md = this->purge_head;
+            this->unqueuePurge(md);
+            purged += this->releasePages(md, md->freeUnreleased());
+            md->freeUnreleased() = 0;
+        }
+    }
+
+    static int histogramBucket(size_t size)
+    {
+        int b = 63 - __builtin_clzl(size | 1);
+        return (b < STATS_FREE_BUCKETS) ? b : STATS_FREE_BUCKETS - 1;
+    }
+    MallocMetadata* takeFreeBlock(size_t size)
+    {
+        MallocMetadata* md = this->free_index.take(size);
+        if (md != nullptr)
+        {
+            this->free_histogram[histogramBucket(md->size())]--;
+            if (md->size() >= PURGE_MIN_SIZE)
+            {
+                this->unqueuePurge(md);
+            }
+        }
+        return md;
+    }
+    void insertFreeBlock(MallocMetadata* meta)
+    {
+        this->free_histogram[histogramBucket(meta->size())]++;
+        this->free_index.insert(meta);
+        if (meta->size() >= PURGE_MIN_SIZE)
+        {
+            this->queuePurge(meta);
+        }
+    }
+    void removeFreeBlock(MallocMetadata* meta)
+    {
+        this->free_histogram[histogramBucket(meta->size())]--;
+        this->free_index.remove(meta);
+        if (meta->size() >= PURGE_MIN_SIZE)
+        {
+            this->unqueuePurge(meta);
+        }
+    }
+    //add this arena to stats, caller holds the lock. constant time but for
+    //the highest TLSF list.
+    void addStats(SmallocStats* stats)
+    {
+        size_t slab_bytes = 0;
+        size_t free_slab_bytes = 0;
+        for (int i = 0; i < SLAB_CLASSES; i++)
+        {
+            stats->class_slabs[i] += this->class_slabs[i];
+            stats->class_used_slots[i] += this->class_used_slots[i];
+            size_t slot_size = 8 * (i + 1);
+            size_t slots = this->class_slabs[i] * ((SLAB_SIZE - SLAB_HEADER_SIZE) / slot_size);
+            slab_bytes += slots * slot_size;
+            free_slab_bytes += (slots - this->class_used_slots[i]) * slot_size;
+        }
+        for (int i = 0; i < STATS_FREE_BUCKETS; i++)
+        {
+            stats->free_histogram[i] += this->free_histogram[i];
+        }
+        stats->allocated_blocks += this->alloc_blocks;
+        stats->allocated_bytes += this->alloc_bytes;
+        stats->free_blocks += this->free_blocks;
+        stats->free_bytes += this->free_bytes;
+        stats->meta_data_bytes += this->getMetaDataBytes();
+        stats->heap_bytes += this->alloc_bytes - this->mapped_bytes - slab_bytes;
+        stats->heap_free_bytes += this->free_bytes - free_slab_bytes;
+        stats->heap_unused_bytes += (this->heap_top == nullptr) ? 0 : this->heap_end - this->heap_top;
+        stats->mmapped_blocks += this->big_blocks;
+        stats->mmapped_bytes += this->mapped_bytes;
+        stats->slab_bytes += slab_bytes;
+        size_t largest = this->free_index.largest();
+        if (largest > stats->largest_free_block)
+        {
+            stats->largest_free_block = largest;
+        }
+        if (this->isMainArena())
+        {
+            stats->mmap_threshold = this->mmap_threshold;
+            stats->trim_threshold = this->getTrimThreshold();
+        }
+        stats->splits += this->splits;
+        stats->merges += this->merges;
+        stats->heap_extensions += this->heap_extensions;
+        stats->heap_growths += this->heap_growths;
+        stats->mmap_calls += this->mmap_calls;
+        stats->fast_blocks += this->fast_blocks;
+        stats->fast_bytes += this->fast_bytes;
+        stats->purged_bytes += this->purged_bytes;
+    }
+    size_t getDirtyBytes()
+    {
+        return this->dirty_bytes;
+    }
+    size_t getAllocBytes()
+    {
+        return this->alloc_bytes;
+    }
+    size_t getFreeBytes ()
+    {
+        return this->free_bytes;
+    }
+    size_t getAllocBlocks()
+    {
+        return this->alloc_blocks;
+    }
+    size_t getFreeBlocks ()
+    {
+        return this->free_blocks;
+    }
+    size_t getMetaDataBytes()
+    {
+        return (this->alloc_blocks - this->slab_slots) * sizeof(MallocMetadata) + this->big_blocks * sizeof(BigBlock) + this->num_slabs * SLAB_HEADER_SIZE;
+    }   
+};
+
+bool MallocList::background = false;
+
+class ListGuard {
+    MallocList& m_list;
+public:
+    explicit ListGuard(MallocList& m_list) : m_list(m_list)
+    {
+        m_list.lock();
+    }
+    ~ListGuard()
+    {
+        m_list.unlock();
+    }
+};
+
+// per thread stack of freed small payloads, linked through their first word.
+// cached memory is busy as far as MallocList (and the _num_ functions) knows,
+// only refills and flushes take the lock.
+class ThreadCache {
+    void* bins[TCACHE_BINS];
+    int counts[TCACHE_BINS];
+    static int binIndex(size_t size)
+    {
+        return size / 8 - 1;
+    }
+    static void*& nextOf(void* p)
+    {
+        return *(void**)p;
+    }
+    void push(void* p, size_t size)
+    {
+        int idx = binIndex(size);
+        nextOf(p) = this->bins[idx];
+        this->bins[idx] = p;
+        this->counts[idx]++;
+    }
+    //give all but the keep newest payloads of the bin back to their arenas
+    void flush(int idx, int keep)
+    {
+        if (this->counts[idx] <= keep)
+        {
+            return;
+        }
+        void* last_kept = nullptr;
+        void* tmp = this->bins[idx];
+        for (int i = 0; i < keep; i++)
+        {
+            last_kept = tmp;
+            tmp = nextOf(tmp);
+        }
+        if (last_kept == nullptr)
+        {
+            this->bins[idx] = nullptr;
+        }
+        else
+        {
+            nextOf(last_kept) = nullptr;
+        }
+        this->counts[idx] = keep;
+        //only the arena we run on is locked, payloads of other arenas are queued to them
+        MallocList& local = MallocList::pickArena();
+        bool locked = false;
+        while (tmp != nullptr)
+        {
+            void* next = nextOf(tmp);
+            MallocList& owner = MallocList::ownerOf(tmp);
+            if (&owner != &local)
+            {
+                owner.pushRemoteFree(tmp);
+            }
+            else
+            {
+                if (!locked)
+                {
+                    local.lock();
+                    locked = true;
+                }
+                local.release(tmp);
+            }
+            tmp = next;
+        }
+        if (locked)
+        {
+            local.unlock();
+        }
+    }
+    void* refill(MallocList& m_list, size_t size)
+    {
+        ListGuard guard(m_list);
+        void* p = m_list.allocate(size);
+        for (int i = 1; p != nullptr && i < TCACHE_BATCH; i++)
+        {
+            void* extra = m_list.allocate(size);
+            if (extra == nullptr)
+            {
+                break;
+            }
+            size_t extra_size = MallocList::usableSize(extra);
+            if (extra_size > TCACHE_MAX_SIZE || this->counts[binIndex(extra_size)] >= TCACHE_COUNT)
+            {
+                m_list.release(extra);
+                break;
+            }
+            this->push(extra, extra_size);
+        }
+        return p;
+    }
+public:
+    ThreadCache()
+    {
+        for (int i = 0; i < TCACHE_BINS; i++)
+        {
+            this->bins[i] = nullptr;
+            this->counts[i] = 0;
+        }
+    }
+    ~ThreadCache()
+    {
+        for (int i = 0; i < TCACHE_BINS; i++)
+        {
+            this->flush(i, 0);
+        }
+    }
+    // size is aligned and at most TCACHE_MAX_SIZE
+    void* get(size_t size)
+    {
+        int idx = binIndex(size);
+        void* p = this->bins[idx];
+        if (p != nullptr)
+        {
+            this->bins[idx] = nextOf(p);
+            this->counts[idx]--;
+            return p;
+        }
+        //refill: one lock for a whole batch
+        MallocList& m_list = MallocList::pickArena();
+        p = this->refill(m_list, size);
+        if (p == nullptr && !m_list.isMainArena()) //arena heap is full
+        {
+            p = this->refill(MallocList::getArena(0), size);
+        }
+        return p;
+    }
+    // returns false if p is not cacheable and should go to its arena
+    bool put(void* p)
+    {
+        size_t size = MallocList::usableSize(p);
+        if (size > TCACHE_MAX_SIZE || (!MallocList::isSlot(p) && ((MallocMetadata*)p - 1)->isMmap()))
+        {
+            return false;
+        }
+        this->putSized(p, size);
+        return true;
+    }
+    //p is a slot or heap block of exactly size usable bytes
+    void putSized(void* p, size_t size)
+    {
+        this->push(p, size);
+        int idx = binIndex(size);
+        if (this->counts[idx] >= TCACHE_COUNT)
+        {
+            this->flush(idx, TCACHE_COUNT - TCACHE_BATCH);
+        }
+    }
+};
+
+thread_local ThreadCache tcache;
+
+//start of a trace file, followed by capacity records. head counts every
+//record ever written, record i is at i % capacity.
+typedef struct trace_header_t {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t capacity;
+    uint64_t head;
+    uint64_t start_ns; // CLOCK_MONOTONIC when the trace started
+}TraceHeader;
+
+//info is the size (TRACE_SIZE_BITS), then the thread (TRACE_THREAD_BITS),
+//then the op. it is written last, a record with info 0 is empty.
+typedef struct trace_record_t {
+    uint64_t time_ns; // since start_ns
+    uint64_t ptr;
+    uint64_t old_ptr;
+    uint64_t info;
+}TraceRecord;
+
+//opt-in recorder of every smalloc / scalloc / saligned_alloc / sfree /
+//srealloc into a ring buffer in a shared file mapping. when it is off an
+//operation pays one load and branch. allocations are recorded after they
+//happen and frees before, so an address is recorded free before it can be
+//recorded handed out again. a mapping is kept until exit after stop(),
+//since other threads may still be writing to it.
+class MallocTrace {
+    static TraceHeader* header;
+    static std::atomic<uint32_t> threads;
+    static uint32_t threadId()
+    {
+        static thread_local uint32_t id = 0;
+        if (id == 0)
+        {
+            id = threads.fetch_add(1, std::memory_order_relaxed) % ((1 << TRACE_THREAD_BITS) - 1) + 1;
+        }
+        return id;
+    }
+    static uint64_t nowNs()
+    {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t)ts.tv_sec * 1000000000UL + ts.tv_nsec;
+    }
+    static void write(TraceHeader* trace, int op, void* p, uint64_t old_ptr, size_t size)
+    {
+        uint64_t i = __atomic_fetch_add(&trace->head, 1, __ATOMIC_RELAXED);
+        TraceRecord* record = (TraceRecord*)(trace + 1) + i % trace->capacity;
+        __atomic_store_n(&record->info, 0, __ATOMIC_RELAXED);
+        record->time_ns = nowNs() - trace->start_ns;
+        record->ptr = (uint64_t)p;
+        record->old_ptr = old_ptr;
+        uint64_t info = ((uint64_t)size & (((uint64_t)1 << TRACE_SIZE_BITS) - 1)) |
+                        ((uint64_t)threadId() << TRACE_SIZE_BITS) |
+                        ((uint64_t)op << (TRACE_SIZE_BITS + TRACE_THREAD_BITS));
+        __atomic_store_n(&record->info, info, __ATOMIC_RELEASE);
+    }
+public:
+    //records into path, which is truncated to hold records records.
+    //returns 0, or an errno value
+    static int start(const char* path, size_t records)
+    {
+        if (records == 0)
+        {
+            records = TRACE_DEFAULT_RECORDS;
+        }
+        size_t length = sizeof(TraceHeader) + records * sizeof(TraceRecord);
+        int fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0)
+        {
+            return errno;
+        }
+        if (ftruncate(fd, length) != 0)
+        {
+            int error = errno;
+            close(fd);
+            return error;
+        }
+        void* p = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        int error = errno;
+        close(fd);
+        if (p == (void*)(-1))
+        {
+            return error;
+        }
+        TraceHeader* trace = (TraceHeader*)p;
+        trace->magic = TRACE_MAGIC;
+        trace->version = TRACE_VERSION;
+        trace->capacity = records;
+        trace->head = 0;
+        trace->start_ns = nowNs();
+        __atomic_store_n(&header, trace, __ATOMIC_RELEASE);
+        return 0;
+    }
+    static void stop()
+    {
+        TraceHeader* trace = __atomic_exchange_n(&header, nullptr, __ATOMIC_ACQ_REL);
+        if (trace != nullptr)
+        {
+            msync(trace, sizeof(TraceHeader) + trace->capacity * sizeof(TraceRecord), MS_ASYNC);
+        }
+    }
+    static void record(int op, void* p, uint64_t old_ptr, size_t size)
+    {
+        TraceHeader* trace = __atomic_load_n(&header, __ATOMIC_ACQUIRE);
+        if (trace != nullptr)
+        {
+            write(trace, op, p, old_ptr, size);
+        }
+    }
+};
+
+TraceHeader* MallocTrace::header = nullptr;
+std::atomic<uint32_t> MallocTrace::threads(0);
+
+//one sampled live allocation
+typedef struct profile_sample_t {
+    void* p;
+    profile_sample_t* next; // in its bucket
+    size_t size; // requested
+    uint64_t stack_hash;
+    int depth;
+    void* stack[PROFILE_MAX_DEPTH];
+}ProfileSample;
+
+//opt-in sampling heap profiler: on average one allocation per rate bytes
+//is sampled (the distance to the next sample is drawn from an exponential
+//distribution, per thread) and its call stack is kept until it is freed.
+//like MallocTrace, a call pays one load and branch while it is off.
+//samples are kept in a hash table of chains mapped on the first start.
+//frees walk their chain without the lock (usually an empty bucket), only
+//the frees of sampled blocks take it. a removed sample goes to the back
+//of a queue of free entries, so a chain a reader is walking is not reused
+//under it.
+class HeapProfiler {
+    static size_t rate; // 0 when off
+    static ProfileSample** buckets; // PROFILE_BUCKETS chains
+    static ProfileSample* samples; // PROFILE_MAX_SAMPLES entries
+    static uint32_t* unused; // queue of free entries
+    static size_t unused_head;
+    static size_t unused_count;
+    static pthread_mutex_t mutex;
+    typedef struct unwind_state_t {
+        void** stack;
+        int depth;
+    }UnwindState;
+    static _Unwind_Reason_Code unwindFrame(struct _Unwind_Context* context, void* arg)
+    {
+        UnwindState* state = (UnwindState*)arg;
+        void* ip = (void*)_Unwind_GetIP(context);
+        if (ip == nullptr || state->depth == PROFILE_INNER_FRAMES + PROFILE_MAX_DEPTH)
+        {
+            return _URC_END_OF_STACK;
+        }
+        state->stack[state->depth++] = ip;
+        return _URC_NO_REASON;
+    }
+    static ProfileSample*& bucketOf(void* p)
+    {
+        return buckets[(size_t)(((uint64_t)p >> 4) * 0x9E3779B97F4A7C15ULL >> 32) & (PROFILE_BUCKETS - 1)];
+    }
+    //every entry is unused, caller holds the lock
+    static void clear()
+    {
+        for (size_t i = 0; i < PROFILE_BUCKETS; i++)
+        {
+            __atomic_store_n(&buckets[i], nullptr, __ATOMIC_RELEASE);
+        }
+        for (uint32_t i = 0; i < PROFILE_MAX_SAMPLES; i++)
+        {
+            unused[i] = i;
+        }
+        unused_head = 0;
+        unused_count = PROFILE_MAX_SAMPLES;
+    }
+    //bytes to allocate before the next sample of this thread
+    static int64_t nextDistance(size_t mean)
+    {
+        static thread_local uint64_t seed = 0;
+        if (seed == 0)
+        {
+            seed = ((uint64_t)(uintptr_t)&seed * 0x9E3779B97F4A7C15ULL) ^ (uint64_t)clock();
+            seed |= 1;
+        }
+        seed ^= seed << 13; //xorshift64
+        seed ^= seed >> 7;
+        seed ^= seed << 17;
+        double u = ((seed >> 11) + 1) * (1.0 / 9007199254740992.0); // (0, 1]
+        return (int64_t)(-log(u) * mean) + 1;
+    }
+    //caller is the return address of the s* function, the stack starts
+    //there. tail calls and inlining make the number of frames above it vary.
+    static void sample(void* p, size_t size, void* caller)
+    {
+        static thread_local bool busy = false; //the unwinder may allocate the first time
+        if (busy)
+        {
+            return;
+        }
+        busy = true;
+        void* frames[PROFILE_INNER_FRAMES + PROFILE_MAX_DEPTH];
+        UnwindState state = {frames, 0};
+        _Unwind_Backtrace(unwindFrame, &state);
+        int first = 0;
+        while (first < state.depth && first < PROFILE_INNER_FRAMES && frames[first] != caller)
+        {
+            first++;
+        }
+        if (first == state.depth || frames[first] != caller)
+        {
+            first = 1; //only this function is known to be ours
+        }
+        void** stack = frames + first;
+        int depth = (state.depth - first < PROFILE_MAX_DEPTH) ? state.depth - first : PROFILE_MAX_DEPTH;
+        uint64_t hash = 0;
+        for (int i = 0; i < depth; i++)
+        {
+            hash = (hash ^ (uint64_t)stack[i]) * 0x100000001B3ULL;
+        }
+        pthread_mutex_lock(&mutex);
+        if (__atomic_load_n(&rate, __ATOMIC_RELAXED) != 0 && unused_count > 0) //a full table drops samples
+        {
+            ProfileSample* sample = &samples[unused[unused_head]];
+            unused_head = (unused_head + 1) % PROFILE_MAX_SAMPLES;
+            unused_count--;
+            sample->p = p;
+            sample->size = size;
+            sample->stack_hash = hash;
+            sample->depth = depth;
+            memcpy(sample->stack, stack, depth * sizeof(void*));
+            ProfileSample*& head = bucketOf(p);
+            sample->next = head;
+            __atomic_store_n(&head, sample, __ATOMIC_RELEASE);
+        }
+        pthread_mutex_unlock(&mutex);
+        busy = false;
+    }
+    static void forget(void* p)
+    {
+        ProfileSample*& head = bucketOf(p);
+        ProfileSample* sample = __atomic_load_n(&head, __ATOMIC_ACQUIRE);
+        while (sample != nullptr && sample->p != p)
+        {
+            sample = __atomic_load_n(&sample->next, __ATOMIC_ACQUIRE);
+        }
+        if (sample == nullptr)
+        {
+            return;
+        }
+        pthread_mutex_lock(&mutex);
+        for (ProfileSample** link = &head; *link != nullptr; link = &(*link)->next)
+        {
+            if ((*link)->p == p)
             {
-                if (this->free_list_head == this->wilderness)
-                {
-                    this->free_list_head = nullptr;
-                }
-                size_t old_size = this->wilderness->size;
-                MallocMetadata* meta_ret = unionWilderness(size);
-                if (meta_ret == nullptr)
-                {//sbrk failed
-                    return nullptr;
-                }
-                this->updateBusyBlock(this->wilderness); //updates free, free next & prev
-                this->free_blocks --;
-                this->free_bytes -= old_size;
-                return meta_ret;
+                sample = *link;
+                __atomic_store_n(link, sample->next, __ATOMIC_RELEASE);
+                unused[(unused_head + unused_count) % PROFILE_MAX_SAMPLES] = sample - samples;
+                unused_count++;
+                break;
+            }
+        }
+        pthread_mutex_unlock(&mutex);
+    }
+    static void writeOut(int fd, char* buf, size_t* used)
+    {
+        size_t done = 0;
+        while (done < *used)
+        {
+            ssize_t n = ::write(fd, buf + done, *used - done);
+            if (n <= 0)
+            {
+                break;
             }
-            else 
+            done += n;
+        }
+        *used = 0;
+    }
+    //counts size bytes towards this thread's next sample
+    static void account(void* p, size_t size, size_t mean, void* caller)
+    {
+        static thread_local int64_t countdown = -1; //drawn on the first allocation
+        if (countdown < 0)
+        {
+            countdown = nextDistance(mean);
+        }
+        countdown -= size;
+        if (countdown < 0)
+        {
+            countdown = nextDistance(mean);
+            sample(p, size, caller);
+        }
+    }
+    static bool sameStack(ProfileSample* a, ProfileSample* b)
+    {
+        return a->stack_hash == b->stack_hash && a->depth == b->depth &&
+               memcmp(a->stack, b->stack, a->depth * sizeof(void*)) == 0;
+    }
+public:
+    //samples one allocation per rate bytes on average, 0 means
+    //PROFILE_DEFAULT_RATE. returns 0, or an errno value
+    static int start(size_t sample_rate)
+    {
+        pthread_mutex_lock(&mutex);
+        if (buckets == nullptr)
+        {
+            size_t length = PROFILE_BUCKETS * sizeof(ProfileSample*) + PROFILE_MAX_SAMPLES * (sizeof(ProfileSample) + sizeof(uint32_t));
+            void* p = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+            if (p == (void*)(-1))
             {
-                //allocate a new block if there is no free block available
-                void* p = Sbrk(size + sizeof(MallocMetadata));
-                if (p == nullptr)
+                pthread_mutex_unlock(&mutex);
+                return ENOMEM;
+            }
+            buckets = (ProfileSample**)p;
+            samples = (ProfileSample*)(buckets + PROFILE_BUCKETS);
+            unused = (uint32_t*)(samples + PROFILE_MAX_SAMPLES);
+            clear();
+        }
+        __atomic_store_n(&rate, (sample_rate == 0) ? PROFILE_DEFAULT_RATE : sample_rate, __ATOMIC_RELEASE);
+        pthread_mutex_unlock(&mutex);
+        return 0;
+    }
+    //drops every sample. the table stays mapped, other threads may still read it
+    static void stop()
+    {
+        pthread_mutex_lock(&mutex);
+        __atomic_store_n(&rate, 0, __ATOMIC_RELEASE);
+        if (buckets != nullptr)
+        {
+            clear();
+        }
+        pthread_mutex_unlock(&mutex);
+    }
+    //inlined into the s* function, whose caller starts the stack
+    __attribute__((always_inline)) static void allocated(void* p, size_t size)
+    {
+        size_t mean = __atomic_load_n(&rate, __ATOMIC_ACQUIRE);
+        if (mean != 0)
+        {
+            account(p, size, mean, __builtin_return_address(0));
+        }
+    }
+    static void freed(void* p)
+    {
+        if (__atomic_load_n(&rate, __ATOMIC_ACQUIRE) != 0)
+        {
+            forget(p);
+        }
+    }
+    //writes the live samples to fd in the legacy heap profile format that
+    //pprof reads: one line per call stack with its sampled objects and
+    //bytes, scaled by pprof itself (heap_v2/rate), then /proc/self/maps to
+    //symbolize with. returns 0, or an errno value
+    static int dump(int fd)
+    {
+        //the text is formatted under the lock into this mapping and written
+        //after it, so threads that sample or free do not wait on fd
+        size_t line = 64 + PROFILE_MAX_DEPTH * 20;
+        size_t text_size = PROFILE_MAX_SAMPLES * line + line;
+        size_t length = PROFILE_MAX_SAMPLES * sizeof(uint32_t) + text_size;
+        void* p = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+        if (p == (void*)(-1))
+        {
+            return ENOMEM;
+        }
+        uint32_t* order = (uint32_t*)p;
+        char* text = (char*)(order + PROFILE_MAX_SAMPLES);
+        pthread_mutex_lock(&mutex);
+        size_t mean = (rate == 0) ? PROFILE_DEFAULT_RATE : rate;
+        size_t count = 0;
+        if (buckets != nullptr)
+        {
+            for (size_t i = 0; i < PROFILE_BUCKETS; i++)
+            {
+                for (ProfileSample* sample = buckets[i]; sample != nullptr; sample = sample->next)
                 {
-                    return nullptr;
+                    order[count++] = sample - samples;
                 }
-                MallocMetadata* meta_data = (MallocMetadata*)p;
-                this->updateNewBlock(meta_data);
-                meta_data->size = size;
-                meta_data->p = (void*)((MallocMetadata*)p + 1);
-                this->insertNewAllocatedBlock(meta_data);
-                return meta_data;
             }
+            std::sort(order, order + count, [](uint32_t a, uint32_t b)
+            {
+                return samples[a].stack_hash < samples[b].stack_hash;
+            });
         }
-        else
+        size_t total_bytes = 0;
+        for (size_t i = 0; i < count; i++)
         {
-            if (this->free_list_head == tmp)
+            total_bytes += samples[order[i]].size;
+        }
+        size_t used = snprintf(text, text_size, "heap profile: %zu: %zu [%zu: %zu] @ heap_v2/%zu\n",
+                               count, total_bytes, count, total_bytes, mean);
+        for (size_t i = 0; i < count;)
+        {
+            ProfileSample* first = &samples[order[i]];
+            size_t objects = 0;
+            size_t bytes = 0;
+            size_t j = i;
+            for (; j < count && sameStack(first, &samples[order[j]]); j++)
             {
-                this->free_list_head = tmp->free_next;
+                objects++;
+                bytes += samples[order[j]].size;
             }
-            //there is a block that is big enough
-            this->updateBusyBlock(tmp); //updates free, free next & prev
-            this->free_blocks --;
-            this->free_bytes -= tmp->size;
-            if (tmp->size >= 128 +  sizeof(MallocMetadata) + size)
+            used += snprintf(text + used, text_size - used, "%zu: %zu [%zu: %zu] @", objects, bytes, objects, bytes);
+            for (int k = 0; k < first->depth; k++)
             {
-                return split(tmp, size);
+                used += snprintf(text + used, text_size - used, " %p", first->stack[k]);
             }
-            return tmp;
-        }   
+            used += snprintf(text + used, text_size - used, "\n");
+            i = j;
+        }
+        pthread_mutex_unlock(&mutex);
+        used += snprintf(text + used, text_size - used, "\nMAPPED_LIBRARIES:\n");
+        writeOut(fd, text, &used);
+        munmap(p, length);
+        char buf[4096];
+        int maps = open("/proc/self/maps", O_RDONLY | O_CLOEXEC);
+        if (maps < 0)
+        {
+            return errno;
+        }
+        ssize_t n;
+        while ((n = read(maps, buf, sizeof(buf))) > 0)
+        {
+            used = n;
+            writeOut(fd, buf, &used);
+        }
+        close(maps);
+        return 0;
     }
-    //get allocated block by pointer
-    MallocMetadata* getBlock (void* p)
+    static void lock()
     {
-        if (p == nullptr)
+        pthread_mutex_lock(&mutex);
+    }
+    static void unlock()
+    {
+        pthread_mutex_unlock(&mutex);
+    }
+};
+
+size_t HeapProfiler::rate = 0;
+ProfileSample** HeapProfiler::buckets = nullptr;
+ProfileSample* HeapProfiler::samples = nullptr;
+uint32_t* HeapProfiler::unused = nullptr;
+size_t HeapProfiler::unused_head = 0;
+size_t HeapProfiler::unused_count = 0;
+pthread_mutex_t HeapProfiler::mutex = PTHREAD_MUTEX_INITIALIZER;
+
+//optional thread that does the slow part of sfree off the callers' path,
+//each task on its own interval (options.*_interval ms, 0 turns it off) and
+//with its own budget per arena and round:
+//  consolidate: up to options.consolidate_budget fast bin blocks
+//  purge: the pages of free blocks that stayed dirty for
+//         options.dirty_decay ms, up to options.purge_budget bytes
+//  trim: the free wilderness over the trim threshold, up to
+//        options.trim_budget bytes
+//every round also unmaps the mappings that aged out of the MapCache.
+//while it runs, sfree neither trims the heap nor drops the pages of big
+//free blocks itself. it takes one arena lock at a time, like smalloc_stats.
+class BackgroundThread {
+    static pthread_t thread;
+    static pthread_mutex_t mutex;
+    static pthread_cond_t wakeup;
+    static bool running;
+    static bool stopping;
+    //when a task with interval ms is next due after it ran at now
+    static long nextRun(long now, size_t interval)
+    {
+        return (interval == 0) ? now + BACKGROUND_MAX_SLEEP * 1000000L : now + (long)interval * 1000000L;
+    }
+    static void round(long now, long* next_consolidate, long* next_purge, long* next_trim)
+    {
+        size_t consolidate_interval = __atomic_load_n(&options.consolidate_interval, __ATOMIC_RELAXED);
+        size_t purge_interval = __atomic_load_n(&options.purge_interval, __ATOMIC_RELAXED);
+        size_t trim_interval = __atomic_load_n(&options.trim_interval, __ATOMIC_RELAXED);
+        bool consolidate = now >= *next_consolidate && consolidate_interval > 0;
+        bool purge = now >= *next_purge && purge_interval > 0;
+        bool trim = now >= *next_trim && trim_interval > 0;
+        MapCache::getInstance().expire();
+        for (int i = 0; i < MallocList::numArenas() && (consolidate || purge || trim); i++)
         {
-            return nullptr;
+            MallocList& m_list = MallocList::getArena(i);
+            ListGuard guard(m_list);
+            m_list.drainRemoteFrees();
+            if (consolidate)
+            {
+                m_list.consolidate(__atomic_load_n(&options.consolidate_budget, __ATOMIC_RELAXED));
+            }
+            if (purge)
+            {
+                long decay = (long)__atomic_load_n(&options.dirty_decay, __ATOMIC_RELAXED) * 1000000L;
+                m_list.purge(decay, __atomic_load_n(&options.purge_budget, __ATOMIC_RELAXED));
+            }
+            if (trim)
+            {
+                m_list.decayThreshold(now);
+                m_list.trimWilderness(__atomic_load_n(&options.trim_budget, __ATOMIC_RELAXED));
+            }
         }
-        MallocMetadata* md = (MallocMetadata*)((MallocMetadata*)p - 1);
-        return md;
+        if (now >= *next_consolidate)
+        {
+            *next_consolidate = nextRun(now, consolidate_interval);
+        }
+        if (now >= *next_purge)
+        {
+            *next_purge = nextRun(now, purge_interval);
+        }
+        if (now >= *next_trim)
+        {
+            *next_trim = nextRun(now, trim_interval);
+        }
+    }
+    static void* run(void*)
+    {
+        long now = MallocList::now();
+        long next_consolidate = now;
+        long next_purge = now;
+        long next_trim = now;
+        pthread_mutex_lock(&mutex);
+        while (!stopping)
+        {
+            pthread_mutex_unlock(&mutex);
+            now = MallocList::now();
+            round(now, &next_consolidate, &next_purge, &next_trim);
+            long wake = std::min(std::min(next_consolidate, next_purge), std::min(next_trim, now + BACKGROUND_MAX_SLEEP * 1000000L));
+            struct timespec ts;
+            ts.tv_sec = wake / 1000000000L;
+            ts.tv_nsec = wake % 1000000000L;
+            pthread_mutex_lock(&mutex);
+            if (!stopping)
+            {
+                pthread_cond_timedwait(&wakeup, &mutex, &ts);
+            }
+        }
+        pthread_mutex_unlock(&mutex);
+        return nullptr;
+    }
+public:
+    //returns 0 (also if it already runs) or an errno value
+    static int start()
+    {
+        pthread_mutex_lock(&mutex);
+        if (running)
+        {
+            pthread_mutex_unlock(&mutex);
+            return 0;
+        }
+        pthread_condattr_t attr;
+        pthread_condattr_init(&attr);
+        pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+        pthread_cond_init(&wakeup, &attr);
+        pthread_condattr_destroy(&attr);
+        stopping = false;
+        //the program's signal handlers never run on this thread
+        sigset_t all;
+        sigset_t old;
+        sigfillset(&all);
+        pthread_sigmask(SIG_SETMASK, &all, &old);
+        int error = pthread_create(&thread, nullptr, run, nullptr);
+        pthread_sigmask(SIG_SETMASK, &old, nullptr);
+        if (error == 0)
+        {
+            running = true;
+            MallocList::setBackground(true);
+        }
+        pthread_mutex_unlock(&mutex);
+        return error;
+    }
+    //the deferred work is done inline again from here on
+    static void stop()
+    {
+        pthread_mutex_lock(&mutex);
+        if (!running)
+        {
+            pthread_mutex_unlock(&mutex);
+            return;
+        }
+        stopping = true;
+        pthread_cond_signal(&wakeup);
+        pthread_mutex_unlock(&mutex);
+        pthread_join(thread, nullptr);
+        for (int i = 0; i < MallocList::numArenas(); i++)
+        {
+            MallocList& m_list = MallocList::getArena(i);
+            ListGuard guard(m_list);
+            m_list.endPartialTrim();
+        }
+        pthread_mutex_lock(&mutex);
+        running = false;
+        MallocList::setBackground(false);
+        pthread_cond_destroy(&wakeup);
+        pthread_mutex_unlock(&mutex);
     }
+    //a forked child has no background thread
+    static void forked()
+    {
+        pthread_mutex_init(&mutex, nullptr);
+        running = false;
+        MallocList::setBackground(false);
+    }
+};
 
-    void freeBigBlock(MallocMetadata* tmp)
+pthread_t BackgroundThread::thread;
+pthread_mutex_t BackgroundThread::mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t BackgroundThread::wakeup;
+bool BackgroundThread::running = false;
+bool BackgroundThread::stopping = false;
+
+
+size_t sumArenas(size_t (MallocList::*getter)(), size_t (BuddyAllocator::*buddy_getter)())
+{
+    size_t sum = 0;
+    for (int i = 0; i < MallocList::numArenas(); i++)
+    {
+        MallocList& m_list = MallocList::getArena(i);
+        ListGuard guard(m_list);
+        m_list.drainRemoteFrees();
+        sum += (m_list.*getter)();
+    }
+#if BUDDY_POLICY != BUDDY_OFF
+    BuddyAllocator& buddy = BuddyAllocator::getInstance();
+    buddy.lock();
+    sum += (buddy.*buddy_getter)();
+    buddy.unlock();
+#else
+    (void)buddy_getter;
+#endif
+    return sum;
+}
+
+size_t _num_free_blocks()
+{
+    return sumArenas(&MallocList::getFreeBlocks, &BuddyAllocator::getFreeBlocks);
+}
+
+size_t _num_free_bytes()
+{
+    return sumArenas(&MallocList::getFreeBytes, &BuddyAllocator::getFreeBytes);
+}
+
+size_t _num_allocated_blocks()
+{
+    return sumArenas(&MallocList::getAllocBlocks, &BuddyAllocator::getAllocBlocks);
+}
+
+size_t _num_allocated_bytes()
+{
+    return sumArenas(&MallocList::getAllocBytes, &BuddyAllocator::getAllocBytes);
+}
+
+size_t _size_meta_data()
+{
+    //Returns the number of bytes of a single meta-data structure in your system.
+    return sizeof(MallocMetadata);
+}
+
+size_t _num_meta_data_bytes()
+{
+    //slots have no header, a slab has one for all of its slots
+    return sumArenas(&MallocList::getMetaDataBytes, &BuddyAllocator::getMetaDataBytes);
+}
+
+//like mallinfo2: a snapshot of every arena, each taken under its own lock
+//in constant time, so it is cheap enough to poll
+void smalloc_stats(SmallocStats* stats)
+{
+    memset(stats, 0, sizeof(SmallocStats));
+    stats->version = STATS_VERSION;
+    stats->num_arenas = MallocList::numArenas();
+    for (int i = 0; i < MallocList::numArenas(); i++)
+    {
+        MallocList& m_list = MallocList::getArena(i);
+        ListGuard guard(m_list);
+        m_list.drainRemoteFrees();
+        m_list.addStats(stats);
+    }
+#if BUDDY_POLICY != BUDDY_OFF
+    BuddyAllocator& buddy = BuddyAllocator::getInstance();
+    buddy.lock();
+    stats->allocated_blocks += buddy.getAllocBlocks();
+    stats->allocated_bytes += buddy.getAllocBytes();
+    stats->free_blocks += buddy.getFreeBlocks();
+    stats->free_bytes += buddy.getFreeBytes();
+    stats->buddy_bytes = buddy.getAllocBytes();
+    buddy.unlock();
+#endif
+    MapCache& cache = MapCache::getInstance();
+    cache.lock();
+    stats->map_cache_bytes = cache.getBytes();
+    cache.unlock();
+    if (stats->heap_free_bytes > 0)
+    {
+        stats->fragmentation = 1 - (double)stats->largest_free_block / stats->heap_free_bytes;
+    }
+}
+
+//appends to a caller's buffer like snprintf, counting what did not fit
+class StatsWriter {
+    char* buf;
+    size_t len;
+    size_t pos;
+    bool json;
+    bool first;
+public:
+    StatsWriter(char* buf, size_t len, bool json)
+    {
+        this->buf = buf;
+        this->len = len;
+        this->pos = 0;
+        this->json = json;
+        this->first = true;
+    }
+    void add(const char* format, ...)
+    {
+        va_list args;
+        va_start(args, format);
+        int n = vsnprintf(this->buf + ((this->pos < this->len) ? this->pos : this->len),
+                          (this->pos < this->len) ? this->len - this->pos : 0, format, args);
+        va_end(args);
+        this->pos += (n > 0) ? n : 0;
+    }
+    void name(const char* name)
+    {
+        this->add(this->json ? "%s\"%s\":" : "%s%s: ", (this->first || !this->json) ? "" : ",", name);
+        this->first = false;
+    }
+    void field(const char* name, size_t value)
+    {
+        this->name(name);
+        this->add(this->json ? "%zu" : "%zu\n", value);
+    }
+    void field(const char* name, double value)
+    {
+        this->name(name);
+        this->add(this->json ? "%.4f" : "%.4f\n", value);
+    }
+    void array(const char* name, const size_t* values, int n)
+    {
+        this->name(name);
+        this->add(this->json ? "[" : "");
+        for (int i = 0; i < n; i++)
+        {
+            this->add("%s%zu", (i == 0) ? "" : (this->json ? "," : " "), values[i]);
+        }
+        this->add(this->json ? "]" : "\n");
+    }
+    size_t length()
+    {
+        return this->pos;
+    }
+};
+
+//writes a smalloc_stats snapshot into buf as text (SM_STATS_TEXT, one
+//"name: value" line each) or as one JSON object (SM_STATS_JSON). like
+//snprintf it returns the length the whole dump needs, buf is always
+//terminated when len > 0.
+size_t smalloc_stats_dump(char* buf, size_t len, int format)
+{
+    SmallocStats stats;
+    smalloc_stats(&stats);
+    StatsWriter out(buf, len, format == SM_STATS_JSON);
+    if (format == SM_STATS_JSON)
+    {
+        out.add("{");
+    }
+    out.field("version", (size_t)stats.version);
+    out.field("num_arenas", (size_t)stats.num_arenas);
+    out.field("allocated_blocks", stats.allocated_blocks);
+    out.field("allocated_bytes", stats.allocated_bytes);
+    out.field("free_blocks", stats.free_blocks);
+    out.field("free_bytes", stats.free_bytes);
+    out.field("meta_data_bytes", stats.meta_data_bytes);
+    out.field("heap_bytes", stats.heap_bytes);
+    out.field("heap_free_bytes", stats.heap_free_bytes);
+    out.field("heap_unused_bytes", stats.heap_unused_bytes);
+    out.field("mmapped_blocks", stats.mmapped_blocks);
+    out.field("mmapped_bytes", stats.mmapped_bytes);
+    out.field("slab_bytes", stats.slab_bytes);
+    out.field("buddy_bytes", stats.buddy_bytes);
+    out.field("map_cache_bytes", stats.map_cache_bytes);
+    out.field("largest_free_block", stats.largest_free_block);
+    out.field("fragmentation", stats.fragmentation);
+    out.field("mmap_threshold", stats.mmap_threshold);
+    out.field("trim_threshold", stats.trim_threshold);
+    out.field("splits", stats.splits);
+    out.field("merges", stats.merges);
+    out.field("heap_extensions", stats.heap_extensions);
+    out.field("heap_growths", stats.heap_growths);
+    out.field("mmap_calls", stats.mmap_calls);
+    out.array("class_slabs", stats.class_slabs, SLAB_CLASSES);
+    out.array("class_used_slots", stats.class_used_slots, SLAB_CLASSES);
+    out.array("free_histogram", stats.free_histogram, STATS_FREE_BUCKETS);
+    out.field("fast_blocks", stats.fast_blocks);
+    out.field("fast_bytes", stats.fast_bytes);
+    out.field("purged_bytes", stats.purged_bytes);
+    if (format == SM_STATS_JSON)
+    {
+        out.add("}\n");
+    }
+    return out.length();
+}
+
+size_t align (size_t size)
+{
+    if (size % 8 != 0)
+    {
+        size = 8*((size / 8) + 1);
+    }
+    if (MALLOC_ALIGNMENT > 8)
+    {
+        //slots are multiples of the alignment, heap blocks end right
+        //before an aligned header
+        if (size <= SLAB_MAX_SIZE)
+        {
+            return (size + MALLOC_ALIGNMENT - 1) / MALLOC_ALIGNMENT * MALLOC_ALIGNMENT;
+        }
+        return MallocList::blockSize(size);
+    }
+    return size;
+}
+//block of the heap or a mapping, *dirty is set to how many of its first
+//bytes may not be zero
+void* arenaAllocate(size_t size, bool is_scalloc, size_t* dirty)
+{
+    MallocList& m_list = MallocList::pickArena();
+    {
+        ListGuard guard(m_list);
+        MallocMetadata* md = nullptr;
+        if (size >= m_list.getMmapThreshold())
+        {
+            md = m_list.allocateBigBlock(size, is_scalloc);
+            *dirty = m_list.getDirtyBytes();
+            return (md == nullptr) ? nullptr : md->p();
+        }
+        md = m_list.findFreeBlock(size);
+        *dirty = m_list.getDirtyBytes();
+        if (md != nullptr || m_list.isMainArena())
+        {
+            return (md == nullptr) ? nullptr : md->p();
+        }
+    }
+    MallocList& main_arena = MallocList::getArena(0); //arena heap is full
+    ListGuard guard(main_arena);
+    MallocMetadata* md = main_arena.findFreeBlock(size);
+    *dirty = main_arena.getDirtyBytes();
+    return (md == nullptr) ? nullptr : md->p();
+}
+
+//scalloc blocks come back zeroed, only the bytes that may be dirty are cleared
+void* allocateBlock(size_t size, bool is_scalloc)
+{
+    if (size == 0 || size > MAX_REQUEST_SIZE)
+    {
+        return nullptr;
+    }
+    size = align(size);
+    void* p = nullptr;
+    size_t dirty = size;
+    if (size <= TCACHE_MAX_SIZE)
+    {
+        p = tcache.get(size);
+    }
+    else
     {
-        if (tmp->lower != nullptr) 
+        if (BuddyAllocator::wants(size))
         {
-            tmp->lower->higher = tmp->higher;
+            p = BuddyAllocator::getInstance().allocate(size);
         }
-        if (tmp->higher != nullptr)
+        if (p == nullptr)
         {
-            tmp->higher->lower = tmp->lower;
+            p = arenaAllocate(size, is_scalloc, &dirty);
         }
-        if (this->mmaped_list_head == tmp)
+    }
+    if (p != nullptr && is_scalloc)
+    {
+        memset(p, 0, (dirty < size) ? dirty : size);
+    }
+    return p;
+}
+
+void* smalloc(size_t size)
+{
+    void* p = allocateBlock(size, false);
+    if (p != nullptr)
+    {
+        MallocTrace::record(TRACE_MALLOC, p, 0, size);
+        HeapProfiler::allocated(p, size);
+    }
+    return p;
+}
+
+void* alignedAllocate(size_t alignment, size_t size)
+{
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0 || size == 0 || size > MAX_REQUEST_SIZE)
+    {
+        return nullptr;
+    }
+    if (alignment <= MALLOC_ALIGNMENT)
+    {
+        return allocateBlock(size, false);
+    }
+    size = align(size);
+    MallocList& m_list = MallocList::pickArena();
+    {
+        ListGuard guard(m_list);
+        MallocMetadata* md = m_list.allocateAligned(size, alignment);
+        if (md != nullptr || m_list.isMainArena())
         {
-            this->mmaped_list_head = tmp->higher;
+            return (md == nullptr) ? nullptr : md->p();
         }
-        this->alloc_bytes -= tmp->size;
-        this->alloc_blocks --;
-        if (tmp->size > this->mmap_threshold)
+    }
+    MallocList& main_arena = MallocList::getArena(0); //arena heap is full
+    ListGuard guard(main_arena);
+    MallocMetadata* md = main_arena.allocateAligned(size, alignment);
+    return (md == nullptr) ? nullptr : md->p();
+}
+
+void* saligned_alloc(size_t alignment, size_t size)
+{
+    void* p = alignedAllocate(alignment, size);
+    if (p != nullptr)
+    {
+        MallocTrace::record(TRACE_ALIGNED, p, alignment, size);
+        HeapProfiler::allocated(p, size);
+    }
+    return p;
+}
+
+int sposix_memalign(void** memptr, size_t alignment, size_t size)
+{
+    if (alignment % sizeof(void*) != 0 || (alignment & (alignment - 1)) != 0 || alignment == 0)
+    {
+        return EINVAL;
+    }
+    void* p = saligned_alloc(alignment, size);
+    if (p == nullptr)
+    {
+        return ENOMEM;
+    }
+    *memptr = p;
+    return 0;
+}
+
+void* scalloc(size_t num, size_t size)
+{
+    void* p = allocateBlock(size*num, true);
+    if (p != nullptr)
+    {
+        MallocTrace::record(TRACE_CALLOC, p, 0, size*num);
+        HeapProfiler::allocated(p, size*num);
+    }
+    return p;
+}
+
+size_t smalloc_batch(size_t size, size_t n, void** out)
+{
+    if (size == 0 || size > MAX_REQUEST_SIZE)
+    {
+        return 0;
+    }
+    size = align(size);
+    if (n > ~(size_t)0 / (size + sizeof(MallocMetadata))) //allocateBatch asks the heap for all n at once
+    {
+        return 0;
+    }
+    size_t done = 0;
+    if (!BuddyAllocator::wants(size))
+    {
+        MallocList& m_list = MallocList::pickArena();
+        ListGuard guard(m_list);
+        done = m_list.allocateBatch(size, n, out);
+    }
+    for (; done < n; done++) //the arena heap is full, or the buddy system serves this size
+    {
+        out[done] = allocateBlock(size, false);
+        if (out[done] == nullptr)
         {
-            this->mmap_threshold = tmp->size;
+            break;
         }
-        munmap(tmp, sizeof(MallocMetadata) + tmp->size);
     }
+    for (size_t i = 0; i < done; i++)
+    {
+        MallocTrace::record(TRACE_MALLOC, out[i], 0, size);
+        HeapProfiler::allocated(out[i], size);
+    }
+    return done;
+}
+
+//free p, which the thread cache did not take
+void releaseBlock(void* p)
+{
+    if (MallocList::isBuddy(p))
+    {
+        BuddyAllocator::getInstance().free(p);
+        return;
+    }
+    MallocList& m_list = MallocList::ownerOf(p);
+    bool is_mmap = !MallocList::isSlot(p) && ((MallocMetadata*)p - 1)->isMmap();
+    if (!is_mmap && &m_list != &MallocList::pickArena())
+    {
+        m_list.pushRemoteFree(p); //coalesced by the owner on its next allocation
+        return;
+    }
+    ListGuard guard(m_list);
+    m_list.release(p);
+}
+
+//free p through the thread cache, p is not null
+void freePointer(void* p)
+{
+    if (tcache.put(p))
+    {
+        return;
+    }
+    releaseBlock(p);
+}
+
+void sfree(void* p)
+{
+    if (p == nullptr)
+    {
+        return;
+    }
+    MallocTrace::record(TRACE_FREE, p, 0, 0);
+    HeapProfiler::freed(p);
+    freePointer(p);
+}
+
+//size is the size p was allocated with, a slot of that size goes to the
+//thread cache without reading its slab, bigger blocks skip the thread cache
+void sfree_sized(void* p, size_t size)
+{
+    if (p == nullptr)
+    {
+        return;
+    }
+    MallocTrace::record(TRACE_FREE, p, 0, 0);
+    HeapProfiler::freed(p);
+    size = align(size);
+    if (size <= SLAB_MAX_SIZE && MallocList::isSlot(p))
+    {
+        tcache.putSized(p, size);
+        return;
+    }
+    if (size > TCACHE_MAX_SIZE)
+    {
+        releaseBlock(p);
+        return;
+    }
+    freePointer(p);
+}
 
-    void freeBlock (void * p)
+//runs of pointers of the same arena are freed under one lock
+void sfree_batch(void** ptrs, size_t n)
+{
+    MallocList* locked = nullptr;
+    for (size_t i = 0; i < n; i++)
     {
+        void* p = ptrs[i];
         if (p == nullptr)
         {
-            return ;
-        }
-        MallocMetadata* md = (MallocMetadata*)((MallocMetadata*)p - 1); 
-        if (md->is_mmap)
-        {
-            this->freeBigBlock(md);
-            return;
-        }
-        md->is_free = true;
-        this->free_blocks ++;
-        this->free_bytes += md->size;
-        bool is_merged = false;
-        if (md->higher != nullptr && md->higher->is_free)
-        {
-            is_merged = true;
-            this->mergeAdjBlocks(md, md->higher, true);
+            continue;
         }
-        if (md->lower != nullptr && md->lower->is_free)
+        MallocTrace::record(TRACE_FREE, p, 0, 0);
+        HeapProfiler::freed(p);
+        if (MallocList::isBuddy(p))
         {
-            is_merged = true;
-            this->mergeAdjBlocks(md->lower, md, true);
+            BuddyAllocator::getInstance().free(p);
+            continue;
         }
-        if (!is_merged)
+        MallocList& owner = MallocList::ownerOf(p);
+        if (&owner != locked)
         {
-            this->insertFreeBlock(md);
+            if (locked != nullptr)
+            {
+                locked->unlock();
+            }
+            owner.lock();
+            locked = &owner;
         }
+        owner.release(p);
     }
+    if (locked != nullptr)
+    {
+        locked->unlock();
+    }
+}
 
-    void insertFreeBlock(MallocMetadata* meta)
+void* reallocatePointer(void* oldp, size_t size)
+{
+    if (size == 0 || size > MAX_REQUEST_SIZE)
     {
-        MallocMetadata* tmp = this->free_list_head;
-        MallocMetadata* prev = nullptr;
-        while (tmp != nullptr && tmp->size < meta->size)
-        {
-            prev = tmp;
-            tmp = tmp->free_next;
-        }
-        while(tmp != nullptr && tmp->size == meta->size && tmp->p < meta->p)
-        {
-            prev = tmp;
-            tmp = tmp->free_next;
-        }
-        meta->free_prev = prev;
-        if (prev != nullptr)
-        {
-            prev->free_next = meta;
-        }
-        else
+        return nullptr;
+    }
+    if(oldp == nullptr)
+    {
+        return allocateBlock(size, false); //realloc with oldp null is malloc
+    }
+    size = align(size);
+    if (MallocList::isSlot(oldp) || MallocList::isBuddy(oldp))
+    {
+        size_t old_size = MallocList::usableSize(oldp);
+        if (old_size >= size)
         {
-            this->free_list_head = meta;
+            return oldp;
         }
-        meta->free_next = tmp;
-        if (tmp != nullptr)
+        void* newp = allocateBlock(size, false);
+        if (newp != nullptr)
         {
-            tmp->free_prev = meta;
+            memmove(newp, oldp, old_size);
+            freePointer(oldp);
         }
+        return newp;
     }
-    size_t getAllocBytes()
+    MallocMetadata* old_meta_data = (MallocMetadata*)oldp - 1;
+    MallocList& m_list = MallocList::ownerOf(oldp);
+    ListGuard guard(m_list);
+    MallocMetadata* result = nullptr;
+    if (old_meta_data->isMmap())
     {
-        return this->alloc_bytes;
+        result = m_list.reallocateBigBlock(old_meta_data, size);
     }
-    size_t getFreeBytes ()
+    else
     {
-        return this->free_bytes;
+        result = m_list.reallocateBlock(old_meta_data, size);
     }
-    size_t getAllocBlocks()
+    if (result == nullptr)
     {
-        return this->alloc_blocks;
+        return nullptr;
     }
-    size_t getFreeBlocks ()
+    return result->p();
+}
+
+void* srealloc(void* oldp, size_t size)
+{
+    if (oldp != nullptr)
     {
-        return this->free_blocks;
-    }   
-};
+        HeapProfiler::freed(oldp); //the sample is lost if the realloc fails
+    }
+    void* p = reallocatePointer(oldp, size);
+    if (p != nullptr)
+    {
+        MallocTrace::record(TRACE_REALLOC, p, (uint64_t)oldp, size);
+        HeapProfiler::allocated(p, size);
+    }
+    return p;
+}
 
+//records every allocation and free into a ring of records at path, see
+//MallocTrace. records 0 means TRACE_DEFAULT_RECORDS. returns 0 or an errno value
+int smalloc_trace_start(const char* path, size_t records)
+{
+    return MallocTrace::start(path, records);
+}
 
-size_t _num_free_blocks()
+void smalloc_trace_stop()
 {
-  MallocList& m_list = MallocList::getInstance();
-  return m_list.getFreeBlocks();
+    MallocTrace::stop();
 }
 
-size_t _num_free_bytes()
+//samples one allocation per sample_bytes allocated on average (0 means
+//PROFILE_DEFAULT_RATE), see HeapProfiler. returns 0 or an errno value
+int smalloc_profile_start(size_t sample_bytes)
 {
-    MallocList& m_list = MallocList::getInstance();
-    return m_list.getFreeBytes();
+    return HeapProfiler::start(sample_bytes);
 }
 
-size_t _num_allocated_blocks()
+//stops sampling and drops the samples
+void smalloc_profile_stop()
 {
-    MallocList& m_list = MallocList::getInstance();
-    return m_list.getAllocBlocks();
+    HeapProfiler::stop();
 }
 
-size_t _num_allocated_bytes()
+//writes the sampled live heap to fd in the format of pprof's heap profiles:
+//  pprof --text ./program heap.prof
+int smalloc_profile_dump(int fd)
 {
-    MallocList& m_list = MallocList::getInstance();
-    return m_list.getAllocBytes();
+    return HeapProfiler::dump(fd);
 }
 
-size_t _size_meta_data()
+//starts the background thread, see BackgroundThread. returns 0 or an errno value
+int smalloc_background_start()
 {
-    //Returns the number of bytes of a single meta-data structure in your system.
-    return sizeof(MallocMetadata);
+    return BackgroundThread::start();
 }
 
-size_t _num_meta_data_bytes()
+//stops it and waits for its round to end
+void smalloc_background_stop()
 {
-    MallocList& m_list = MallocList::getInstance();
-    return m_list.getAllocBlocks() * _size_meta_data();
+    BackgroundThread::stop();
 }
 
-size_t align (size_t size)
+//like mallopt: returns 1 on success, 0 for an unknown parameter or a bad value
+int smallopt(int param, size_t value)
 {
-    if (size % 8 == 0)
+    if (param == SM_TOP_PAD)
+    {
+        __atomic_store_n(&options.top_pad, value, __ATOMIC_RELAXED);
+        return 1;
+    }
+    if (param == SM_HEAP_CHUNK && value > 0)
+    {
+        __atomic_store_n(&options.heap_chunk, value, __ATOMIC_RELAXED);
+        return 1;
+    }
+    if (param == SM_TRIM_THRESHOLD)
     {
-        return size;
+        __atomic_store_n(&options.trim_threshold, value, __ATOMIC_RELAXED);
+        return 1;
     }
-    return 8*((size / 8) + 1);
+    if (param == SM_MMAP_THRESHOLD_MAX && value >= INITIAL_MMAP_THREASHOLD)
+    {
+        __atomic_store_n(&options.mmap_threshold_max, value, __ATOMIC_RELAXED);
+        return 1;
+    }
+    if (param == SM_MMAP_DECAY)
+    {
+        __atomic_store_n(&options.mmap_decay_ms, value, __ATOMIC_RELAXED);
+        return 1;
+    }
+    if (param == SM_FAST_BYTES)
+    {
+        __atomic_store_n(&options.fast_bytes, value, __ATOMIC_RELAXED);
+        return 1;
+    }
+    if (param == SM_CONSOLIDATE_INTERVAL)
+    {
+        __atomic_store_n(&options.consolidate_interval, value, __ATOMIC_RELAXED);
+        return 1;
+    }
+    if (param == SM_CONSOLIDATE_BUDGET && value > 0)
+    {
+        __atomic_store_n(&options.consolidate_budget, value, __ATOMIC_RELAXED);
+        return 1;
+    }
+    if (param == SM_DIRTY_DECAY)
+    {
+        __atomic_store_n(&options.dirty_decay, value, __ATOMIC_RELAXED);
+        return 1;
+    }
+    if (param == SM_PURGE_INTERVAL)
+    {
+        __atomic_store_n(&options.purge_interval, value, __ATOMIC_RELAXED);
+        return 1;
+    }
+    if (param == SM_PURGE_BUDGET && value > 0)
+    {
+        __atomic_store_n(&options.purge_budget, value, __ATOMIC_RELAXED);
+        return 1;
+    }
+    if (param == SM_TRIM_INTERVAL)
+    {
+        __atomic_store_n(&options.trim_interval, value, __ATOMIC_RELAXED);
+        return 1;
+    }
+    if (param == SM_TRIM_BUDGET && value >= (size_t)getpagesize()) //trims go a page at a time
+    {
+        __atomic_store_n(&options.trim_budget, value, __ATOMIC_RELAXED);
+        return 1;
+    }
+    return 0;
 }
-MallocMetadata* allocateBlock(size_t size, bool is_scalloc)
+
+#ifdef MALLOC_PRELOAD
+//the C library's malloc interface, for a shared library build that is
+//loaded with LD_PRELOAD:
+//  g++ -std=c++11 -O2 -shared -fPIC -DMALLOC_PRELOAD malloc_4.cpp -o libmalloc4.so -lpthread
+//nothing here depends on an init step, every structure builds itself on
+//first use with mmap / sbrk, so calls libc makes back into malloc while we
+//are initializing (thread locals, pthread_atfork) are served normally.
+//MALLOC4_TRACE=path records a trace from the start into path.PID (a
+//program it runs inherits the variable), MALLOC4_TRACE_RECORDS sets its length.
+//MALLOC4_PROFILE=path samples the heap from the start and dumps the heap
+//profile into path.PID at exit, MALLOC4_PROFILE_RATE sets the sampling rate.
+//MALLOC4_BACKGROUND=1 starts the background thread.
+#include <stdlib.h>
+#include <limits.h>
+
+//fork must not copy a lock held by another thread, so every lock is taken
+//around it. an arena may lock the main arena while holding its own, so the
+//arenas are locked from the last one down.
+static void forkPrepare()
 {
-    if (size == 0 || size > 1e8 )
+    for (int i = MallocList::numArenas() - 1; i >= 0; i--)
     {
-        return nullptr;
+        MallocList::getArena(i).lock();
     }
-    size = align(size);
-    MallocList& m_list = MallocList::getInstance();
-    if (size >= m_list.getMmapThreshold())
+    if (BUDDY_POLICY != BUDDY_OFF)
     {
-        MallocMetadata* new_md = m_list.allocateBigBlock(size, is_scalloc);
-        return new_md;
+        BuddyAllocator::getInstance().lock();
     }
-    return m_list.findFreeBlock(size);
+    MapCache::getInstance().lock();
+    SlabPool::getInstance().lock();
+    HeapProfiler::lock();
 }
 
-void* smalloc(size_t size)
+static void forkRelease()
 {
-    MallocMetadata* result = allocateBlock(size, false);
-    if (result == nullptr)
+    HeapProfiler::unlock();
+    SlabPool::getInstance().unlock();
+    MapCache::getInstance().unlock();
+    if (BUDDY_POLICY != BUDDY_OFF)
     {
-        return nullptr;
+        BuddyAllocator::getInstance().unlock();
+    }
+    for (int i = 0; i < MallocList::numArenas(); i++)
+    {
+        MallocList::getArena(i).unlock();
     }
-    return result->p;
 }
 
-void* scalloc(size_t num, size_t size)
+//the child would write into the parent's trace file, and only the
+//forking thread lives on in it
+static void forkChild()
 {
-    MallocMetadata* result = allocateBlock(size*num, true);
-    if (result == nullptr)
+    forkRelease();
+    MallocTrace::stop();
+    BackgroundThread::forked();
+}
+
+__attribute__((constructor)) static void registerForkHandlers()
+{
+    pthread_atfork(forkPrepare, forkRelease, forkChild);
+    const char* path = getenv("MALLOC4_TRACE");
+    char trace_path[PATH_MAX];
+    if (path != nullptr && *path != '\0' &&
+        snprintf(trace_path, sizeof(trace_path), "%s.%d", path, (int)getpid()) < (int)sizeof(trace_path))
     {
-        return nullptr;
+        const char* records = getenv("MALLOC4_TRACE_RECORDS");
+        MallocTrace::start(trace_path, (records == nullptr) ? 0 : strtoul(records, nullptr, 10));
+    }
+    if (getenv("MALLOC4_PROFILE") != nullptr)
+    {
+        const char* rate = getenv("MALLOC4_PROFILE_RATE");
+        HeapProfiler::start((rate == nullptr) ? 0 : strtoul(rate, nullptr, 10));
+    }
+    const char* background = getenv("MALLOC4_BACKGROUND");
+    if (background != nullptr && strcmp(background, "1") == 0)
+    {
+        BackgroundThread::start();
     }
-    memset(result->p, 0, size*num);
-    return result->p;
 }
 
-void sfree(void* p)
+__attribute__((destructor)) static void dumpProfile()
 {
-    MallocList& m_list = MallocList::getInstance();
-    m_list.freeBlock(p);
+    const char* path = getenv("MALLOC4_PROFILE");
+    char profile_path[PATH_MAX];
+    if (path != nullptr && *path != '\0' &&
+        snprintf(profile_path, sizeof(profile_path), "%s.%d", path, (int)getpid()) < (int)sizeof(profile_path))
+    {
+        int fd = open(profile_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd >= 0)
+        {
+            HeapProfiler::dump(fd);
+            close(fd);
+        }
+    }
 }
 
-void* srealloc(void* oldp, size_t size)
+extern "C" {
+
+void* malloc(size_t size)
+{
+    void* p = smalloc((size == 0) ? 1 : size);
+    if (p == nullptr)
+    {
+        errno = ENOMEM;
+    }
+    return p;
+}
+
+void free(void* p)
+{
+    sfree(p);
+}
+
+void* calloc(size_t num, size_t size)
 {
-    if (size == 0 || size > 1e8 )
+    if (size != 0 && num > MAX_REQUEST_SIZE / size)
     {
+        errno = ENOMEM;
         return nullptr;
     }
-    if(oldp == nullptr)
+    void* p = scalloc(1, (num * size == 0) ? 1 : num * size);
+    if (p == nullptr)
     {
-        MallocMetadata* result = allocateBlock(size, false); //realloc with oldp null is malloc
-        if (result == nullptr)
-        {
-            return nullptr;
-        }
-        return result->p;    
+        errno = ENOMEM;
     }
-    size = align(size);
-    MallocList& m_list = MallocList::getInstance();
-    MallocMetadata* old_meta_data = m_list.getBlock(oldp);
-    MallocMetadata* result = nullptr;
-    if (old_meta_data->is_mmap)
+    return p;
+}
+
+void* realloc(void* oldp, size_t size)
+{
+    if (oldp != nullptr && size == 0)
     {
-        result = m_list.reallocateBigBlock(old_meta_data, size);
+        sfree(oldp);
+        return nullptr;
     }
-    else
+    void* p = srealloc(oldp, (size == 0) ? 1 : size);
+    if (p == nullptr)
     {
-        result = m_list.reallocateBlock(old_meta_data, size);
+        errno = ENOMEM;
+    }
+    return p;
+}
+
+void* aligned_alloc(size_t alignment, size_t size)
+{
+    void* p = saligned_alloc(alignment, (size == 0) ? 1 : size);
+    if (p == nullptr)
+    {
+        errno = (alignment == 0 || (alignment & (alignment - 1)) != 0) ? EINVAL : ENOMEM;
+    }
+    return p;
+}
+
+//unlike aligned_alloc, any alignment is accepted and rounded up to a power of two
+void* memalign(size_t alignment, size_t size)
+{
+    size_t pow2 = MALLOC_ALIGNMENT;
+    while (pow2 < alignment)
+    {
+        pow2 *= 2;
     }
-    return result->p;
+    return aligned_alloc(pow2, size);
+}
+
+int posix_memalign(void** memptr, size_t alignment, size_t size)
+{
+    return sposix_memalign(memptr, alignment, (size == 0) ? 1 : size);
+}
+
+void* valloc(size_t size)
+{
+    return aligned_alloc(getpagesize(), size);
+}
+
+void* pvalloc(size_t size)
+{
+    size_t page = getpagesize();
+    return aligned_alloc(page, (size + page - 1) / page * page);
+}
+
+size_t malloc_usable_size(void* p)
+{
+    return (p == nullptr) ? 0 : MallocList::usableSize(p);
+}
+
 }
+#endif
@@ -0,0 +1,583 @@
+#include <unistd.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/resource.h>
+#include <sys/ptrace.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <atomic>
+#include <thread>
+#include <vector>
+#include <algorithm>
+
+//multithreaded microbenchmarks for one allocator, linked with one of the
+//malloc_N.cpp files (or with -DBENCH_LIBC, with the C library's malloc).
+//every workload runs in its own child process and prints one JSON line.
+//see the README for the build line of every variant.
+
+#define STRINGIFY(x) #x
+#define NAME_OF(x) STRINGIFY(x)
+#ifndef BENCH_ALLOCATOR
+#define BENCH_ALLOCATOR custom
+#endif
+#define DEFAULT_THREADS 4
+#define DEFAULT_OPS 200000 // per thread
+#define WORKING_SET 1024 // live slots per thread
+#define FIXED_SIZE 64
+#define FIXED_BATCH 64 // blocks allocated before they are all freed
+#define REALLOC_MAX 1024*1024 // realloc chains grow up to this size
+#define LATENCY_SAMPLE 8 // every 8th operation is timed on its own
+
+#ifdef BENCH_LIBC
+void* smalloc(size_t size)
+{
+    return malloc(size);
+}
+void* scalloc(size_t num, size_t size)
+{
+    return calloc(num, size);
+}
+void sfree(void* p)
+{
+    free(p);
+}
+void* srealloc(void* oldp, size_t size)
+{
+    return realloc(oldp, size);
+}
+#define PROVIDED(f) true
+#else
+//malloc_1 has no free, calloc or realloc: they are null and the
+//workloads that need them are reported as unsupported
+void* smalloc(size_t size);
+void* scalloc(size_t num, size_t size) __attribute__((weak));
+void sfree(void* p) __attribute__((weak));
+void* srealloc(void* oldp, size_t size) __attribute__((weak));
+#define PROVIDED(f) (f != nullptr)
+#endif
+
+#ifdef BENCH_SERIALIZE
+//malloc_1 to malloc_3 are not thread safe, every call takes this lock
+static pthread_mutex_t bench_mutex = PTHREAD_MUTEX_INITIALIZER;
+class BenchGuard {
+public:
+    BenchGuard()
+    {
+        pthread_mutex_lock(&bench_mutex);
+    }
+    ~BenchGuard()
+    {
+        pthread_mutex_unlock(&bench_mutex);
+    }
+};
+#else
+class BenchGuard {
+public:
+    BenchGuard()
+    {
+    }
+};
+#endif
+
+static void* benchMalloc(size_t size)
+{
+    BenchGuard guard;
+    return smalloc(size);
+}
+
+static void* benchCalloc(size_t num, size_t size)
+{
+    BenchGuard guard;
+    return scalloc(num, size);
+}
+
+static void benchFree(void* p)
+{
+    if (!PROVIDED(sfree) || p == nullptr) //malloc_1 never frees
+    {
+        return;
+    }
+    BenchGuard guard;
+    sfree(p);
+}
+
+static void* benchRealloc(void* oldp, size_t size)
+{
+    BenchGuard guard;
+    return srealloc(oldp, size);
+}
+
+typedef struct bench_options_t {
+    int threads;
+    long ops;
+    const char* workload; // nullptr runs all of them
+    bool syscalls;
+}BenchOptions;
+
+//state of one thread of a workload
+typedef struct thread_state_t {
+    int id;
+    long ops; // operations done
+    uint64_t seed;
+    std::vector<uint32_t> latencies; // nanoseconds of the timed operations
+    std::vector<void*> slots;
+}ThreadState;
+
+typedef void (*WorkloadFunc)(ThreadState* state, long ops);
+
+typedef struct workload_t {
+    const char* name;
+    WorkloadFunc run;
+    bool needs_calloc;
+    bool needs_realloc;
+}Workload;
+
+static std::atomic<void*>* shared_slots = nullptr; // larson: every thread's slots
+static size_t shared_count = 0;
+
+static uint64_t nextRandom(uint64_t* seed) //xorshift64
+{
+    uint64_t x = *seed;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    *seed = x;
+    return x;
+}
+
+//mostly small sizes, like a real program: 8..512 bytes, 1 in 16 up to 8KB,
+//1 in 256 up to 256KB
+static size_t randomSize(uint64_t* seed)
+{
+    uint64_t r = nextRandom(seed);
+    if (r % 256 == 0)
+    {
+        return 8 + (r >> 8) % (256 * 1024);
+    }
+    if (r % 16 == 0)
+    {
+        return 8 + (r >> 8) % 8192;
+    }
+    return 8 + (r >> 8) % 512;
+}
+
+static long nowNs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+//one operation, timed if it is a sampled one
+#define TIMED(state, i, op) \
+    do \
+    { \
+        if ((i) % LATENCY_SAMPLE == 0) \
+        { \
+            long start_ns = nowNs(); \
+            op; \
+            (state)->latencies.push_back((uint32_t)(nowNs() - start_ns)); \
+        } \
+        else \
+        { \
+            op; \
+        } \
+    } while (0)
+
+//allocate FIXED_BATCH blocks of one size, then free them all
+static void fixedChurn(ThreadState* state, long ops)
+{
+    void* batch[FIXED_BATCH];
+    long i = 0;
+    while (i < ops)
+    {
+        for (int j = 0; j < FIXED_BATCH; j++, i++)
+        {
+            TIMED(state, i, batch[j] = benchMalloc(FIXED_SIZE));
+            *(char*)batch[j] = (char)j;
+        }
+        for (int j = 0; j < FIXED_BATCH; j++, i++)
+        {
+            TIMED(state, i, benchFree(batch[j]));
+        }
+    }
+    state->ops = i;
+}
+
+//a working set of random sizes: a random slot is freed if taken, filled if not
+static void randomSizes(ThreadState* state, long ops)
+{
+    for (long i = 0; i < ops; i++)
+    {
+        void*& slot = state->slots[nextRandom(&state->seed) % WORKING_SET];
+        if (slot != nullptr)
+        {
+            TIMED(state, i, benchFree(slot));
+            slot = nullptr;
+        }
+        else
+        {
+            size_t size = randomSize(&state->seed);
+            TIMED(state, i, slot = benchMalloc(size));
+            *(char*)slot = 1;
+        }
+    }
+    state->ops = ops;
+}
+
+//larson: the slots are shared, so a block is usually freed by another
+//thread than the one that allocated it
+static void larson(ThreadState* state, long ops)
+{
+    for (long i = 0; i < ops; i += 2)
+    {
+        size_t size = randomSize(&state->seed);
+        void* p = nullptr;
+        TIMED(state, i, p = benchMalloc(size));
+        *(char*)p = 1;
+        void* old = shared_slots[nextRandom(&state->seed) % shared_count].exchange(p);
+        TIMED(state, i + 1, benchFree(old));
+    }
+    state->ops = ops;
+}
+
+//grow a block from 16 bytes to REALLOC_MAX by half its size at a time
+static void reallocGrowth(ThreadState* state, long ops)
+{
+    long i = 0;
+    while (i < ops)
+    {
+        size_t size = 16;
+        void* p = nullptr;
+        TIMED(state, i, p = benchMalloc(size));
+        i++;
+        while (size < REALLOC_MAX && i < ops)
+        {
+            size += size / 2;
+            TIMED(state, i, p = benchRealloc(p, size));
+            ((char*)p)[size - 1] = 1;
+            i++;
+        }
+        TIMED(state, i, benchFree(p));
+        i++;
+    }
+    state->ops = i;
+}
+
+//like randomSizes, with zeroed blocks
+static void callocHeavy(ThreadState* state, long ops)
+{
+    for (long i = 0; i < ops; i++)
+    {
+        void*& slot = state->slots[nextRandom(&state->seed) % WORKING_SET];
+        if (slot != nullptr)
+        {
+            TIMED(state, i, benchFree(slot));
+            slot = nullptr;
+        }
+        else
+        {
+            size_t size = randomSize(&state->seed);
+            TIMED(state, i, slot = benchCalloc(1, size));
+            *(char*)slot = 1;
+        }
+    }
+    state->ops = ops;
+}
+
+static const Workload workloads[] = {
+    {"fixed", fixedChurn, false, false},
+    {"random", randomSizes, false, false},
+    {"larson", larson, false, false},
+    {"realloc", reallocGrowth, false, true},
+    {"calloc", callocHeavy, true, false},
+};
+
+//the timed region is marked with this syscall, so a tracer only counts
+//the syscalls of the workload itself
+static void markSyscalls()
+{
+    syscall(SYS_getppid);
+}
+
+static std::atomic<int> ready(0);
+static std::atomic<bool> go(false);
+static std::atomic<int> done(0);
+
+static void threadMain(const Workload* workload, ThreadState* state, long ops)
+{
+    ready++;
+    while (!go.load())
+    {
+        sched_yield();
+    }
+    workload->run(state, ops);
+    done++;
+}
+
+//runs the workload in this process, fills states. returns the seconds it took
+static double runWorkload(const Workload* workload, const BenchOptions& options, std::vector<ThreadState>& states)
+{
+    states.resize(options.threads);
+    if (workload->run == larson)
+    {
+        shared_count = (size_t)WORKING_SET * options.threads;
+        shared_slots = new std::atomic<void*>[shared_count];
+        for (size_t i = 0; i < shared_count; i++)
+        {
+            shared_slots[i] = nullptr;
+        }
+    }
+    std::vector<std::thread> threads;
+    for (int i = 0; i < options.threads; i++)
+    {
+        states[i].id = i;
+        states[i].ops = 0;
+        states[i].seed = 0x9E3779B97F4A7C15ULL * (i + 1);
+        states[i].latencies.reserve(options.ops / LATENCY_SAMPLE + 2);
+        states[i].slots.assign(WORKING_SET, nullptr);
+        threads.push_back(std::thread(threadMain, workload, &states[i], options.ops));
+    }
+    while (ready.load() < options.threads)
+    {
+        sched_yield();
+    }
+    markSyscalls();
+    long start = nowNs();
+    go = true;
+    while (done.load() < options.threads)
+    {
+        sched_yield();
+    }
+    long end = nowNs();
+    markSyscalls();
+    for (size_t i = 0; i < threads.size(); i++)
+    {
+        threads[i].join();
+    }
+    return (end - start) / 1e9;
+}
+
+static uint32_t percentile(std::vector<uint32_t>& values, double fraction)
+{
+    if (values.empty())
+    {
+        return 0;
+    }
+    size_t k = (size_t)(fraction * (values.size() - 1));
+    std::nth_element(values.begin(), values.begin() + k, values.end());
+    return values[k];
+}
+
+//syscalls that get or give back memory
+typedef struct syscall_counts_t {
+    long brk;
+    long mmap;
+    long munmap;
+    long mremap;
+    long madvise;
+}SyscallCounts;
+
+//runs the workload in a traced child and counts its memory syscalls
+//between the two markSyscalls calls. returns false if ptrace is not allowed.
+static bool countSyscalls(const Workload* workload, const BenchOptions& options, SyscallCounts* counts)
+{
+    memset(counts, 0, sizeof(*counts));
+    pid_t child = fork();
+    if (child == 0)
+    {
+        if (ptrace(PTRACE_TRACEME, 0, nullptr, nullptr) != 0)
+        {
+            _exit(1);
+        }
+        raise(SIGSTOP);
+        std::vector<ThreadState> states;
+        runWorkload(workload, options, states);
+        _exit(0);
+    }
+    if (child < 0)
+    {
+        return false;
+    }
+    int status;
+    if (waitpid(child, &status, 0) != child || !WIFSTOPPED(status))
+    {
+        return false;
+    }
+    long trace_options = PTRACE_O_TRACESYSGOOD | PTRACE_O_TRACECLONE | PTRACE_O_EXITKILL;
+    ptrace(PTRACE_SETOPTIONS, child, nullptr, (void*)trace_options);
+    ptrace(PTRACE_SYSCALL, child, nullptr, nullptr);
+    bool counting = false;
+    bool child_exited = false;
+    while (true)
+    {
+        pid_t tid = waitpid(-1, &status, __WALL);
+        if (tid < 0)
+        {
+            break;
+        }
+        if (WIFEXITED(status) || WIFSIGNALED(status))
+        {
+            if (tid == child)
+            {
+                child_exited = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+            }
+            continue;
+        }
+        int signal = 0;
+        if (WSTOPSIG(status) == (SIGTRAP | 0x80))
+        {
+            struct __ptrace_syscall_info info;
+            ptrace(PTRACE_GET_SYSCALL_INFO, tid, (void*)sizeof(info), &info);
+            if (info.op == PTRACE_SYSCALL_INFO_ENTRY)
+            {
+                long nr = (long)info.entry.nr;
+                counting = (nr == SYS_getppid) ? !counting : counting;
+                if (counting)
+                {
+                    counts->brk += (nr == SYS_brk);
+                    counts->mmap += (nr == SYS_mmap);
+                    counts->munmap += (nr == SYS_munmap);
+                    counts->mremap += (nr == SYS_mremap);
+                    counts->madvise += (nr == SYS_madvise);
+                }
+            }
+        }
+        else if (WSTOPSIG(status) != SIGTRAP && WSTOPSIG(status) != SIGSTOP)
+        {
+            signal = WSTOPSIG(status); //a real signal, pass it on
+        }
+        ptrace(PTRACE_SYSCALL, tid, nullptr, (void*)(long)signal);
+    }
+    return child_exited;
+}
+
+//runs the workload in a child process and prints its JSON line
+static void benchWorkload(const Workload* workload, const BenchOptions& options)
+{
+    bool supported = (!workload->needs_calloc || PROVIDED(scalloc)) && (!workload->needs_realloc || PROVIDED(srealloc));
+    if (!supported)
+    {
+        printf("{\"allocator\":\"%s\",\"workload\":\"%s\",\"threads\":%d,\"supported\":false}\n",
+               NAME_OF(BENCH_ALLOCATOR), workload->name, options.threads);
+        fflush(stdout);
+        return;
+    }
+    int fds[2];
+    if (pipe(fds) != 0)
+    {
+        return;
+    }
+    fflush(stdout);
+    pid_t child = fork();
+    if (child == 0)
+    {
+        close(fds[0]);
+        std::vector<ThreadState> states;
+        double seconds = runWorkload(workload, options, states);
+        long ops = 0;
+        std::vector<uint32_t> latencies;
+        for (size_t i = 0; i < states.size(); i++)
+        {
+            ops += states[i].ops;
+            latencies.insert(latencies.end(), states[i].latencies.begin(), states[i].latencies.end());
+        }
+        struct rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+        char line[512];
+        int length = snprintf(line, sizeof(line),
+            "\"ops\":%ld,\"seconds\":%.6f,\"ops_per_sec\":%.0f,\"p50_ns\":%u,\"p99_ns\":%u,\"p999_ns\":%u,\"peak_rss_kb\":%ld",
+            ops, seconds, ops / seconds, percentile(latencies, 0.5), percentile(latencies, 0.99),
+            percentile(latencies, 0.999), usage.ru_maxrss);
+        if (write(fds[1], line, length) != length)
+        {
+            _exit(1);
+        }
+        _exit(0);
+    }
+    close(fds[1]);
+    char line[512];
+    ssize_t length = (child < 0) ? -1 : read(fds[0], line, sizeof(line) - 1);
+    close(fds[0]);
+    int status = 0;
+    if (child > 0)
+    {
+        waitpid(child, &status, 0);
+    }
+    if (length <= 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+    {
+        printf("{\"allocator\":\"%s\",\"workload\":\"%s\",\"threads\":%d,\"supported\":true,\"failed\":true,\"signal\":%d}\n",
+               NAME_OF(BENCH_ALLOCATOR), workload->name, options.threads, WIFSIGNALED(status) ? WTERMSIG(status) : 0);
+        fflush(stdout);
+        return;
+    }
+    line[length] = '\0';
+    printf("{\"allocator\":\"%s\",\"workload\":\"%s\",\"threads\":%d,\"supported\":true,%s",
+           NAME_OF(BENCH_ALLOCATOR), workload->name, options.threads, line);
+    SyscallCounts counts;
+    if (options.syscalls && countSyscalls(workload, options, &counts))
+    {
+        printf(",\"syscalls\":{\"brk\":%ld,\"mmap\":%ld,\"munmap\":%ld,\"mremap\":%ld,\"madvise\":%ld}",
+               counts.brk, counts.mmap, counts.munmap, counts.mremap, counts.madvise);
+    }
+    printf("}\n");
+    fflush(stdout);
+}
+
+static void usage(const char* program)
+{
+    fprintf(stderr, "usage: %s [--threads N] [--ops N] [--workload fixed|random|larson|realloc|calloc] [--no-syscalls]\n", program);
+    exit(2);
+}
+
+int main(int argc, char** argv)
+{
+    BenchOptions options = {DEFAULT_THREADS, DEFAULT_OPS, nullptr, true};
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc)
+        {
+            options.threads = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--ops") == 0 && i + 1 < argc)
+        {
+            options.ops = atol(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--workload") == 0 && i + 1 < argc)
+        {
+            options.workload = argv[++i];
+        }
+        else if (strcmp(argv[i], "--no-syscalls") == 0)
+        {
+            options.syscalls = false;
+        }
+        else
+        {
+            usage(argv[0]);
+        }
+    }
+    if (options.threads < 1 || options.ops < 2)
+    {
+        usage(argv[0]);
+    }
+    bool found = false;
+    for (size_t i = 0; i < sizeof(workloads) / sizeof(workloads[0]); i++)
+    {
+        if (options.workload == nullptr || strcmp(options.workload, workloads[i].name) == 0)
+        {
+            benchWorkload(&workloads[i], options);
+            found = true;
+        }
+    }
+    if (!found)
+    {
+        usage(argv[0]);
+    }
+    return 0;
+}
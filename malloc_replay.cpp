@@ -0,0 +1,404 @@
+#include <unistd.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <vector>
+#include <unordered_map>
+
+//replays a trace recorded by malloc_4 (smalloc_trace_start, or
+//MALLOC4_TRACE with the LD_PRELOAD build) against one allocator, linked
+//with one of the malloc_N.cpp files (or with -DBENCH_LIBC, with the C
+//library's malloc). the trace is replayed on one thread, in the order the
+//records were written, and one JSON line is printed with the time, the RSS
+//and the fragmentation over time. see the README for the build lines.
+
+#define STRINGIFY(x) #x
+#define NAME_OF(x) STRINGIFY(x)
+#ifndef BENCH_ALLOCATOR
+#define BENCH_ALLOCATOR custom
+#endif
+#define DEFAULT_SAMPLES 20 // RSS samples over the replay
+
+//the trace layout, as written by MallocTrace in malloc_4.cpp
+#define TRACE_MAGIC 0x4352544d
+#define TRACE_VERSION 1
+#define TRACE_MALLOC 1
+#define TRACE_CALLOC 2
+#define TRACE_FREE 3
+#define TRACE_REALLOC 4
+#define TRACE_ALIGNED 5
+#define TRACE_SIZE_BITS 48
+#define TRACE_THREAD_BITS 12
+#define NO_SLOT 0xffffffffu
+
+typedef struct trace_header_t {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t capacity;
+    uint64_t head;
+    uint64_t start_ns;
+}TraceHeader;
+
+typedef struct trace_record_t {
+    uint64_t time_ns;
+    uint64_t ptr;
+    uint64_t old_ptr;
+    uint64_t info;
+}TraceRecord;
+
+#ifdef BENCH_LIBC
+void* smalloc(size_t size)
+{
+    return malloc(size);
+}
+void* scalloc(size_t num, size_t size)
+{
+    return calloc(num, size);
+}
+void sfree(void* p)
+{
+    free(p);
+}
+void* srealloc(void* oldp, size_t size)
+{
+    return realloc(oldp, size);
+}
+void* saligned_alloc(size_t alignment, size_t size)
+{
+    void* p = nullptr;
+    return (posix_memalign(&p, alignment, size) == 0) ? p : nullptr;
+}
+#define PROVIDED(f) true
+#else
+//only malloc_4 has saligned_alloc, and malloc_1 has no free, calloc or
+//realloc: the missing ones are null and replaced as described in replayOp
+void* smalloc(size_t size);
+void* scalloc(size_t num, size_t size) __attribute__((weak));
+void sfree(void* p) __attribute__((weak));
+void* srealloc(void* oldp, size_t size) __attribute__((weak));
+void* saligned_alloc(size_t alignment, size_t size) __attribute__((weak));
+#define PROVIDED(f) (f != nullptr)
+#endif
+
+//one record, with the recorded addresses replaced by slots: a slot is a
+//block from its allocation to its free, numbered before the replay so that
+//the replay itself allocates nothing but the blocks of the trace
+typedef struct replay_op_t {
+    uint8_t op;
+    uint32_t slot;
+    uint32_t old_slot; // realloc: the block that is resized, or NO_SLOT
+    uint64_t size;
+    uint64_t alignment;
+}ReplayOp;
+
+typedef struct replay_stats_t {
+    uint64_t records; // in the trace, before the ones that were lost to the ring
+    uint64_t lost; // overwritten by newer records, or reallocs of an address already handed out again
+    uint64_t skipped; // incomplete, or frees of blocks allocated before the trace
+    uint64_t failed; // allocations that returned null
+    uint64_t slots;
+}ReplayStats;
+
+typedef struct replay_sample_t {
+    uint64_t op;
+    double seconds;
+    long rss_kb;
+    uint64_t live_bytes;
+}ReplaySample;
+
+static double nowSeconds()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static long rssKb()
+{
+    FILE* file = fopen("/proc/self/statm", "r");
+    if (file == nullptr)
+    {
+        return 0;
+    }
+    long pages = 0, resident = 0;
+    if (fscanf(file, "%ld %ld", &pages, &resident) != 2)
+    {
+        resident = 0;
+    }
+    fclose(file);
+    return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+//a recorded address while it is live
+typedef struct live_block_t {
+    uint32_t slot;
+    uint32_t thread; // that allocated it
+    bool reused; // it was handed out while an older block at the address was live
+}LiveBlock;
+
+//reads the trace at path into ops. returns false if it is not a trace
+static bool loadTrace(const char* path, std::vector<ReplayOp>& ops, ReplayStats* stats)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+    {
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(TraceHeader))
+    {
+        close(fd);
+        return false;
+    }
+    void* p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED)
+    {
+        return false;
+    }
+    const TraceHeader* header = (const TraceHeader*)p;
+    if (header->magic != TRACE_MAGIC || header->version != TRACE_VERSION || header->capacity == 0 ||
+        sizeof(TraceHeader) + header->capacity * sizeof(TraceRecord) > (size_t)st.st_size)
+    {
+        munmap(p, st.st_size);
+        return false;
+    }
+    const TraceRecord* records = (const TraceRecord*)(header + 1);
+    uint64_t first = (header->head > header->capacity) ? header->head - header->capacity : 0;
+    stats->records = header->head - first;
+    stats->lost = first;
+    std::unordered_map<uint64_t, LiveBlock> live; // recorded address -> its current block
+    std::vector<uint32_t> free_slots;
+    ops.reserve(stats->records);
+    for (uint64_t i = first; i < header->head; i++)
+    {
+        const TraceRecord& record = records[i % header->capacity];
+        ReplayOp op;
+        op.op = record.info >> (TRACE_SIZE_BITS + TRACE_THREAD_BITS);
+        op.size = record.info & (((uint64_t)1 << TRACE_SIZE_BITS) - 1);
+        op.slot = NO_SLOT;
+        op.old_slot = NO_SLOT;
+        op.alignment = (op.op == TRACE_ALIGNED) ? record.old_ptr : 0;
+        uint32_t thread = (record.info >> TRACE_SIZE_BITS) & ((1 << TRACE_THREAD_BITS) - 1);
+        if (record.info == 0 || op.op < TRACE_MALLOC || op.op > TRACE_ALIGNED)
+        {
+            stats->skipped++;
+            continue;
+        }
+        std::unordered_map<uint64_t, LiveBlock>::iterator it = live.end();
+        if (op.op == TRACE_FREE || (op.op == TRACE_REALLOC && record.old_ptr != 0))
+        {
+            it = live.find((op.op == TRACE_FREE) ? record.ptr : record.old_ptr);
+            if (it == live.end() && op.op == TRACE_FREE)
+            {
+                stats->skipped++;
+                continue;
+            }
+        }
+        //a realloc is recorded after it freed the old block, so another
+        //thread may have been handed the old address (and recorded it) in
+        //between. a realloc from another thread of an address that was
+        //handed out again may be of either block: it is dropped.
+        if (op.op == TRACE_REALLOC && it != live.end() && it->second.reused && it->second.thread != thread)
+        {
+            stats->lost++;
+            continue;
+        }
+        if (op.op == TRACE_FREE || (op.op == TRACE_REALLOC && it != live.end()))
+        {
+            //a realloc of a block from before the trace is replayed as a malloc
+            op.old_slot = it->second.slot;
+            live.erase(it);
+            if (op.op == TRACE_FREE)
+            {
+                op.slot = op.old_slot;
+                free_slots.push_back(op.slot);
+                ops.push_back(op);
+                continue;
+            }
+        }
+        //an address handed out again while it is live was freed without a
+        //record of its own (a realloc is recorded after it freed the old
+        //block, or the free was lost): the old block is freed first
+        it = live.find(record.ptr);
+        bool reused = it != live.end();
+        if (reused)
+        {
+            ReplayOp implicit_free = {TRACE_FREE, it->second.slot, it->second.slot, 0, 0};
+            ops.push_back(implicit_free);
+            free_slots.push_back(it->second.slot);
+            live.erase(it);
+        }
+        if (op.old_slot != NO_SLOT)
+        {
+            op.slot = op.old_slot; //a realloc keeps its slot
+        }
+        else if (!free_slots.empty())
+        {
+            op.slot = free_slots.back();
+            free_slots.pop_back();
+        }
+        else
+        {
+            op.slot = stats->slots++;
+        }
+        LiveBlock block = {op.slot, thread, reused};
+        live[record.ptr] = block;
+        ops.push_back(op);
+    }
+    munmap(p, st.st_size);
+    return true;
+}
+
+//runs one op against the allocator. returns false if an allocation failed
+static bool replayOp(const ReplayOp& op, std::vector<void*>& blocks, std::vector<uint64_t>& sizes, uint64_t* live_bytes)
+{
+    void* p = nullptr;
+    switch (op.op)
+    {
+    case TRACE_FREE:
+        if (PROVIDED(sfree) && blocks[op.slot] != nullptr) //malloc_1 never frees
+        {
+            sfree(blocks[op.slot]);
+        }
+        blocks[op.slot] = nullptr;
+        *live_bytes -= sizes[op.slot];
+        sizes[op.slot] = 0;
+        return true;
+    case TRACE_CALLOC:
+        p = PROVIDED(scalloc) ? scalloc(1, op.size) : smalloc(op.size);
+        break;
+    case TRACE_ALIGNED:
+        //without saligned_alloc the block is allocated unaligned
+        p = PROVIDED(saligned_alloc) ? saligned_alloc(op.alignment, op.size) : smalloc(op.size);
+        break;
+    case TRACE_REALLOC:
+        if (op.old_slot != NO_SLOT && PROVIDED(srealloc))
+        {
+            p = srealloc(blocks[op.slot], op.size);
+            if (p == nullptr)
+            {
+                return false; //the old block is still in its slot
+            }
+            *live_bytes -= sizes[op.slot];
+            break;
+        }
+        if (op.old_slot != NO_SLOT)
+        {
+            //without srealloc, a new block replaces the old one
+            p = smalloc(op.size);
+            if (p != nullptr && blocks[op.slot] != nullptr)
+            {
+                memmove(p, blocks[op.slot], (sizes[op.slot] < op.size) ? sizes[op.slot] : op.size);
+                if (PROVIDED(sfree))
+                {
+                    sfree(blocks[op.slot]);
+                }
+            }
+            *live_bytes -= sizes[op.slot];
+            break;
+        }
+        p = smalloc(op.size);
+        break;
+    default:
+        p = smalloc(op.size);
+        break;
+    }
+    blocks[op.slot] = p;
+    sizes[op.slot] = (p == nullptr) ? 0 : op.size;
+    *live_bytes += sizes[op.slot];
+    return p != nullptr;
+}
+
+static void usage(const char* program)
+{
+    fprintf(stderr, "usage: %s [--samples N] TRACE\n", program);
+    exit(2);
+}
+
+int main(int argc, char** argv)
+{
+    const char* path = nullptr;
+    long samples = DEFAULT_SAMPLES;
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--samples") == 0 && i + 1 < argc)
+        {
+            samples = atol(argv[++i]);
+        }
+        else if (path == nullptr && argv[i][0] != '-')
+        {
+            path = argv[i];
+        }
+        else
+        {
+            usage(argv[0]);
+        }
+    }
+    if (path == nullptr || samples < 1)
+    {
+        usage(argv[0]);
+    }
+    std::vector<ReplayOp> ops;
+    ReplayStats stats = {0, 0, 0, 0, 0};
+    if (!loadTrace(path, ops, &stats))
+    {
+        fprintf(stderr, "%s: not a malloc_4 trace: %s\n", argv[0], path);
+        return 1;
+    }
+    std::vector<void*> blocks(stats.slots, nullptr);
+    std::vector<uint64_t> sizes(stats.slots, 0);
+    std::vector<ReplaySample> timeline;
+    timeline.reserve(samples + 1);
+    uint64_t every = ops.size() / samples + 1;
+    uint64_t live_bytes = 0;
+    uint64_t peak_live_bytes = 0;
+    long base_rss_kb = rssKb(); //the trace and the replay's own vectors
+    long peak_rss_kb = 0;
+    double seconds = 0;
+    for (uint64_t done = 0; done < ops.size();)
+    {
+        uint64_t end = (done + every < ops.size()) ? done + every : ops.size();
+        double start = nowSeconds();
+        for (; done < end; done++)
+        {
+            if (!replayOp(ops[done], blocks, sizes, &live_bytes))
+            {
+                stats.failed++;
+            }
+            if (live_bytes > peak_live_bytes)
+            {
+                peak_live_bytes = live_bytes;
+            }
+        }
+        seconds += nowSeconds() - start; //the RSS samples are not timed
+        ReplaySample sample = {done, seconds, rssKb() - base_rss_kb, live_bytes};
+        if (sample.rss_kb > peak_rss_kb)
+        {
+            peak_rss_kb = sample.rss_kb;
+        }
+        timeline.push_back(sample);
+    }
+    printf("{\"allocator\":\"%s\",\"trace\":\"%s\",\"records\":%lu,\"lost\":%lu,\"skipped\":%lu,\"failed\":%lu,"
+           "\"ops\":%lu,\"seconds\":%.6f,\"ops_per_sec\":%.0f,\"peak_rss_kb\":%ld,\"peak_live_kb\":%lu,\"timeline\":[",
+           NAME_OF(BENCH_ALLOCATOR), path, stats.records, stats.lost, stats.skipped, stats.failed,
+           (unsigned long)ops.size(), seconds, (seconds > 0) ? ops.size() / seconds : 0,
+           peak_rss_kb, peak_live_bytes / 1024);
+    for (size_t i = 0; i < timeline.size(); i++)
+    {
+        //fragmentation: the part of the memory the allocator added that is not live
+        long rss_kb = timeline[i].rss_kb;
+        double fragmentation = (rss_kb > 0) ? 1 - (timeline[i].live_bytes / 1024.0) / rss_kb : 0;
+        printf("%s{\"ops\":%lu,\"seconds\":%.6f,\"rss_kb\":%ld,\"live_kb\":%lu,\"fragmentation\":%.3f}",
+               (i == 0) ? "" : ",", timeline[i].op, timeline[i].seconds, rss_kb,
+               timeline[i].live_bytes / 1024, (fragmentation < 0) ? 0 : fragmentation);
+    }
+    printf("]}\n");
+    return 0;
+}